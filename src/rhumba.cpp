@@ -7,21 +7,91 @@
 #include <Rcpp.h>
 
 #include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <exception>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <iterator>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <set>
+#include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
+#include <unordered_map>
 #include <unordered_set>
 
 #include <csignal>
+#include <fcntl.h>
+#ifdef _WIN32
+#include <io.h>
+#include <process.h>
+#include <sys/locking.h>
+#include <sys/stat.h>
+#else
+#include <poll.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <spawn.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#include <ghc/filesystem.hpp>
+#include <nlohmann/json.hpp>
+
+#include <openssl/evp.h>
 
 #include "mamba/api/c_api.h"
 
 
 namespace r = Rcpp;
+namespace fs = ghc::filesystem;
+using nlohmann::json;
 
 // [[Rcpp::plugins(cpp17)]]
 
+// Values set through rhumba, so that the parts implemented on this side
+// (templates, pins, caches...) see the same configuration as libmamba.
+std::map<std::string, std::string> config_values;
+
+// Values a ScopedConfig currently overrides, which the Rscript processes
+// started for a solve must see as well.
+std::map<std::string, std::string> scoped_values;
+
+// The prefix or environment name libmamba currently targets, as last passed
+// to set_prefix().
+std::string current_prefix;
+
+// Settings implemented by rhumba itself, which libmamba does not know about.
+const std::unordered_set<std::string> rhumba_settings = {
+    "sharded_repodata", "repodata_allow", "repodata_deny", "repodata_seeds", "snapshot",
+    "repodata_threads", "solve_timeout", "solve_iterations"
+};
+
+bool setting_enabled(const std::string& name)
+{
+    auto it = config_values.find(name);
+    return it != config_values.end() && (it->second == "true" || it->second == "TRUE" || it->second == "1");
+}
+
 void set_config(const char* name, const std::vector<std::string>& values)
 {
     std::vector<std::string> separated_values;
@@ -33,7 +103,9 @@ void set_config(const char* name, const std::vector<std::string>& values)
     }
 
     std::string value = std::accumulate(separated_values.begin(), separated_values.end(), std::string(""));
-    mamba_set_config(name, value.data());
+    config_values[name] = value;
+    if (!rhumba_settings.count(name))
+        mamba_set_config(name, value.data());
 }
 
 void set_specs(const std::vector<std::string>& specs)
@@ -50,13 +122,17 @@ void set_channels(const std::vector<std::string>& channels)
 // [[Rcpp::export]]
 void set_config(const char* name, const char* value)
 {
-    mamba_set_config(name, value);
+    config_values[name] = value;
+    if (!rhumba_settings.count(name))
+        mamba_set_config(name, value);
 }
 
 // [[Rcpp::export]]
 void clear_config(const char* name)
 {
-    mamba_clear_config(name);
+    config_values.erase(name);
+    if (!rhumba_settings.count(name))
+        mamba_clear_config(name);
 }
 
 void set_prefix(const char* prefix)
@@ -65,6 +141,7 @@ void set_prefix(const char* prefix)
 
     if (!prefix_str.empty())
     {
+        current_prefix = prefix_str;
         if (prefix_str.find_first_of("/\\") == std::string::npos)
         {
             mamba_set_cli_config("env_name", prefix);
@@ -81,65 +158,7047 @@ void hide_banner()
     mamba_set_config("show_banner", "false");
 }
 
-// [[Rcpp::export]]
-void print_config()
+std::string get_env(const char* name)
 {
-    mamba_use_conda_root_prefix();
-    mamba_config_list();
+    const char* value = std::getenv(name);
+    return value ? value : "";
 }
 
-// [[Rcpp::export]]
-void list(const char* regex = "", const char* prefix = "")
+fs::path root_prefix()
 {
-    mamba_use_conda_root_prefix();
-    set_prefix(prefix);
-    mamba_list(regex);
+    auto it = config_values.find("root_prefix");
+    if (it != config_values.end() && !it->second.empty())
+        return it->second;
+
+    std::string root = get_env("MAMBA_ROOT_PREFIX");
+    if (root.empty())
+        root = get_env("CONDA_PREFIX");
+    if (!root.empty())
+        return root;
+
+    // Same guess as the Makevars: R lives in <prefix>/lib/R.
+    std::string r_home = get_env("R_HOME");
+    if (r_home.empty())
+        r::stop("Could not determine the root prefix, set it with set_config(\"root_prefix\", ...)");
+    return (fs::path(r_home) / ".." / "..").lexically_normal();
 }
 
-// [[Rcpp::export]]
-void create(const std::vector<std::string>& specs, const char* prefix)
+// Same rules as set_prefix: a bare name is an environment of the root prefix,
+// anything with a separator is a path, and an empty string is the active one.
+fs::path resolve_prefix(const std::string& prefix)
 {
-    mamba_use_conda_root_prefix();
-    hide_banner();
-    set_specs(specs);
-    set_prefix(prefix);
-    mamba_create();
+    fs::path path;
+    if (prefix.empty())
+    {
+        std::string active = get_env("CONDA_PREFIX");
+        path = active.empty() ? root_prefix() : fs::path(active);
+    }
+    else if (prefix.find_first_of("/\\") == std::string::npos)
+    {
+        path = root_prefix() / "envs" / prefix;
+    }
+    else
+    {
+        path = prefix;
+    }
+
+    std::string normalized = fs::absolute(path).lexically_normal().string();
+    while (normalized.size() > 1 && (normalized.back() == '/' || normalized.back() == '\\'))
+        normalized.pop_back();
+    return normalized;
 }
 
-// [[Rcpp::export]]
-void install(const std::vector<std::string>& specs, const char* prefix = "")
+fs::path rhumba_dir()
 {
-    mamba_use_conda_root_prefix();
-    hide_banner();
-    set_specs(specs);
-    set_prefix(prefix);
-    mamba_install();
+    std::string dir = get_env("RHUMBA_HOME");
+    if (dir.empty())
+    {
+        std::string home = get_env("HOME");
+        if (home.empty())
+            home = get_env("USERPROFILE");
+        dir = (fs::path(home) / ".rhumba").string();
+    }
+    fs::create_directories(dir);
+    return dir;
 }
 
-// [[Rcpp::export]]
-void update(const std::vector<std::string>& specs, int update_all = 0, const char* prefix = "")
+fs::path pkgs_dir()
 {
-    mamba_use_conda_root_prefix();
-    hide_banner();
-    set_specs(specs);
-    set_prefix(prefix);
-    mamba_update(update_all);
+    auto it = config_values.find("pkgs_dirs");
+    if (it != config_values.end() && !it->second.empty())
+        return it->second.substr(0, it->second.find(','));
+    return root_prefix() / "pkgs";
 }
 
-// [[Rcpp::export]]
-void remove(const std::vector<std::string>& specs, int remove_all = 0, const char* prefix = "")
+struct LockStats
+{
+    double acquired = 0;
+    double contended = 0;
+    double wait_seconds = 0;
+    double max_wait_seconds = 0;
+};
+
+std::map<std::string, LockStats> lock_stats_by_kind;
+
+struct HeldLock
+{
+    int count = 0;
+    bool exclusive = false;
+};
+
+// Locks this process holds. flock() locks taken through two descriptors
+// conflict even within one process, so nested scopes (e.g. rollback looking
+// up packages during its transaction) reuse the lock already held.
+std::map<std::string, HeldLock> held_locks;
+
+// Advisory lock on a file, shared between every process using the same root.
+// Polls instead of blocking so that R interrupts still work while waiting.
+class FileLock
+{
+public:
+    FileLock(const fs::path& path, const std::string& kind, bool exclusive = true)
+        : m_key(path.string())
+    {
+        auto held = held_locks.find(m_key);
+        if (held != held_locks.end())
+        {
+            if (exclusive && !held->second.exclusive)
+                r::stop("Cannot lock " + m_key + " exclusively while holding it shared");
+            ++held->second.count;
+            return;
+        }
+
+        fs::create_directories(path.parent_path());
+#ifdef _WIN32
+        m_fd = _open(path.string().c_str(), _O_RDWR | _O_CREAT, _S_IREAD | _S_IWRITE);
+#else
+        m_fd = open(path.string().c_str(), O_RDWR | O_CREAT, 0666);
+#endif
+        if (m_fd < 0)
+            r::stop("Could not open lock file " + path.string());
+
+        auto start = std::chrono::steady_clock::now();
+        bool waited = false;
+        while (!try_lock(exclusive))
+        {
+            if (!waited)
+                r::Rcout << "Waiting for " << kind << " lock " << path.string() << std::endl;
+            waited = true;
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            try
+            {
+                r::checkUserInterrupt();
+            }
+            catch (...)
+            {
+                close_fd();
+                throw;
+            }
+        }
+
+        double wait = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        LockStats& stats = lock_stats_by_kind[kind];
+        stats.acquired += 1;
+        stats.contended += waited ? 1 : 0;
+        stats.wait_seconds += wait;
+        stats.max_wait_seconds = std::max(stats.max_wait_seconds, wait);
+        held_locks[m_key] = { 1, exclusive };
+    }
+
+    ~FileLock()
+    {
+        if (--held_locks[m_key].count > 0)
+            return;
+        held_locks.erase(m_key);
+#ifdef _WIN32
+        _lseek(m_fd, 0, SEEK_SET);
+        _locking(m_fd, _LK_UNLCK, 1);
+#else
+        flock(m_fd, LOCK_UN);
+#endif
+        close_fd();
+    }
+
+    FileLock(const FileLock&) = delete;
+    FileLock& operator=(const FileLock&) = delete;
+
+    static bool held(const fs::path& path)
+    {
+        return held_locks.count(path.string()) > 0;
+    }
+
+private:
+    bool try_lock(bool exclusive)
+    {
+#ifdef _WIN32
+        // _locking has no shared mode, readers take the lock exclusively.
+        _lseek(m_fd, 0, SEEK_SET);
+        return _locking(m_fd, _LK_NBLCK, 1) == 0;
+#else
+        return flock(m_fd, (exclusive ? LOCK_EX : LOCK_SH) | LOCK_NB) == 0;
+#endif
+    }
+
+    void close_fd()
+    {
+#ifdef _WIN32
+        _close(m_fd);
+#else
+        close(m_fd);
+#endif
+    }
+
+    std::string m_key;
+    int m_fd = -1;
+};
+
+fs::path prefix_lock_path(const fs::path& prefix)
+{
+    return prefix.parent_path() / ("." + prefix.filename().string() + ".rhumba.lock");
+}
+
+fs::path repodata_lock_path()
+{
+    return pkgs_dir() / "cache" / "rhumba.lock";
+}
+
+// Locks taken by a transaction, always in the same order to avoid deadlocks
+// between processes: the target prefix, the repodata cache, the package cache.
+// The caches are only locked shared: libmamba locks each repodata file and
+// tarball it writes, so transactions on different prefixes run side by side.
+// A dry run only reads the prefix, alongside other readers.
+struct TransactionLock
+{
+    explicit TransactionLock(const char* prefix, bool dry_run = false)
+        : prefix_lock(prefix_lock_path(resolve_prefix(prefix)), "prefix", !dry_run)
+        , repodata_lock(repodata_lock_path(), "repodata", false)
+        , pkgs_lock(pkgs_dir() / "rhumba.lock", "package cache", false)
+    {
+    }
+
+    FileLock prefix_lock;
+    FileLock repodata_lock;
+    FileLock pkgs_lock;
+};
+
+// Redirects what libmamba writes to stdout and stderr into pipes, keeping a
+// copy: one thread per stream passes it on as it is written, to the original
+// fd, or to `sink` when there is one.
+class OutputTee
+{
+public:
+    explicit OutputTee(std::function<void(const char*, std::size_t)> sink = nullptr)
+        : m_sink(std::move(sink))
+    {
+        std::cout.flush();
+        std::cerr.flush();
+        std::fflush(stdout);
+        std::fflush(stderr);
+
+        // Everything that can fail is done before stdout and stderr are
+        // touched, and undone if it does.
+        int pipes[2][2] = { { -1, -1 }, { -1, -1 } };
+        int originals[2] = { -1, -1 };
+        auto close_all = [&]() {
+            for (auto& fds : pipes)
+            {
+                for (int& fd : fds)
+                {
+                    if (fd >= 0)
+                        close(fd);
+                    fd = -1;
+                }
+            }
+            for (int& fd : originals)
+            {
+                if (fd >= 0)
+                    close(fd);
+                fd = -1;
+            }
+        };
+        for (int i = 0; i < 2; ++i)
+        {
+#ifdef _WIN32
+            bool piped = _pipe(pipes[i], 65536, _O_BINARY) == 0;
+#else
+            bool piped = pipe(pipes[i]) == 0;
+#endif
+            originals[i] = piped ? dup(i + 1) : -1;
+            if (originals[i] < 0)
+            {
+                close_all();
+                r::stop("Could not create a pipe to capture output");
+            }
+        }
+
+        // A reader owns its read end once it runs, and stops at EOF, when the
+        // last write end is closed.
+        std::vector<std::thread> readers;
+        try
+        {
+            for (int i = 0; i < 2; ++i)
+            {
+                readers.emplace_back([this, read_end = pipes[i][0], original = originals[i]]() {
+                    char buffer[4096];
+                    int n;
+                    while ((n = read(read_end, buffer, sizeof(buffer))) > 0)
+                    {
+                        std::lock_guard<std::mutex> guard(m_mutex);
+                        m_output.append(buffer, n);
+                        if (m_sink)
+                        {
+                            m_sink(buffer, n);
+                            continue;
+                        }
+                        auto written = write(original, buffer, n);
+                        (void) written;
+                    }
+                    close(read_end);
+                });
+                pipes[i][0] = -1;
+            }
+        }
+        catch (...)
+        {
+            for (auto& fds : pipes)
+            {
+                if (fds[1] >= 0)
+                    close(fds[1]);
+                fds[1] = -1;
+            }
+            for (auto& reader : readers)
+                reader.join();
+            close_all();
+            r::stop("Could not start a thread to capture output");
+        }
+
+        for (int i = 0; i < 2; ++i)
+        {
+            dup2(pipes[i][1], i + 1);
+            close(pipes[i][1]);
+            m_originals.push_back(originals[i]);
+        }
+        m_readers = std::move(readers);
+    }
+
+    ~OutputTee()
+    {
+        finish();
+    }
+
+    OutputTee(const OutputTee&) = delete;
+    OutputTee& operator=(const OutputTee&) = delete;
+
+    std::string finish()
+    {
+        if (m_originals.empty())
+            return m_output;
+        std::cout.flush();
+        std::cerr.flush();
+        std::fflush(stdout);
+        std::fflush(stderr);
+        // Once the pipes' last write ends are replaced, the readers see EOF.
+        for (std::size_t i = 0; i < m_originals.size(); ++i)
+            dup2(m_originals[i], static_cast<int>(i) + 1);
+        for (auto& reader : m_readers)
+            reader.join();
+        m_readers.clear();
+        for (int original : m_originals)
+            close(original);
+        m_originals.clear();
+        return m_output;
+    }
+
+private:
+    std::function<void(const char*, std::size_t)> m_sink;
+    std::vector<int> m_originals;
+    std::vector<std::thread> m_readers;
+    std::mutex m_mutex;
+    std::string m_output;
+};
+
+// One problem reported by the solver, split into the packages and the
+// constraint involved.
+struct SolveConflict
+{
+    std::string type;
+    std::string package;
+    std::string requirement;
+    std::string conflicts_with;
+    std::string text;
+};
+
+// Matches `line` against literal parts with a field between each pair of
+// them, an empty last part standing for the rest of the line.
+bool match_parts(const std::string& line, const std::vector<std::string>& parts, std::vector<std::string>& fields)
+{
+    fields.clear();
+    if (line.compare(0, parts[0].size(), parts[0]) != 0)
+        return false;
+    std::size_t pos = parts[0].size();
+    for (std::size_t i = 1; i < parts.size(); ++i)
+    {
+        std::size_t end;
+        if (i + 1 < parts.size())
+            end = line.find(parts[i], pos);
+        else if (parts[i].empty())
+            end = line.size();
+        else
+            end = line.size() >= parts[i].size() && line.compare(line.size() - parts[i].size(), parts[i].size(), parts[i]) == 0
+                      ? line.size() - parts[i].size()
+                      : std::string::npos;
+        if (end == std::string::npos || end < pos)
+            return false;
+        fields.push_back(line.substr(pos, end - pos));
+        pos = end + parts[i].size();
+    }
+    return true;
+}
+
+// The problem lines libsolv writes, most specific first.
+SolveConflict parse_problem(const std::string& line)
+{
+    struct Pattern
+    {
+        const char* type;
+        std::vector<std::string> parts;
+        std::vector<std::string SolveConflict::*> fields;
+    };
+    static const std::vector<Pattern> patterns = {
+        { "missing", { "nothing provides requested ", "" }, { &SolveConflict::requirement } },
+        { "missing", { "nothing provides ", " needed by ", "" }, { &SolveConflict::requirement, &SolveConflict::package } },
+        { "requires",
+          { "package ", " requires ", ", but none of the providers can be installed" },
+          { &SolveConflict::package, &SolveConflict::requirement } },
+        { "conflict", { "cannot install both ", " and ", "" }, { &SolveConflict::package, &SolveConflict::conflicts_with } },
+        { "conflict",
+          { "package ", " conflicts with ", " provided by ", "" },
+          { &SolveConflict::package, &SolveConflict::requirement, &SolveConflict::conflicts_with } },
+        { "constraint",
+          { "package ", " has constraint ", " conflicting with ", "" },
+          { &SolveConflict::package, &SolveConflict::requirement, &SolveConflict::conflicts_with } },
+        { "obsoletes",
+          { "package ", " obsoletes ", " provided by ", "" },
+          { &SolveConflict::package, &SolveConflict::requirement, &SolveConflict::conflicts_with } },
+        { "excluded", { "package ", " is excluded by strict repo priority" }, { &SolveConflict::package } },
+        { "conflict", { "conflicting requests" }, {} },
+    };
+
+    SolveConflict conflict;
+    conflict.text = line;
+    std::vector<std::string> fields;
+    for (auto& pattern : patterns)
+    {
+        if (!match_parts(line, pattern.parts, fields))
+            continue;
+        conflict.type = pattern.type;
+        for (std::size_t i = 0; i < fields.size(); ++i)
+            conflict.*pattern.fields[i] = fields[i];
+        return conflict;
+    }
+    conflict.type = "other";
+    return conflict;
+}
+
+std::string r_string(const std::string& value)
+{
+    std::string quoted = "\"";
+    for (char c : value)
+    {
+        if (c == '"' || c == '\\')
+            quoted += '\\';
+        quoted += c;
+    }
+    return quoted + "\"";
+}
+
+// Expression that gives an Rscript child the configuration of this session,
+// with the values currently overridden by a ScopedConfig if `scoped`.
+std::string config_expression(bool scoped = false)
+{
+    auto values = config_values;
+    if (scoped)
+    {
+        for (auto& [name, value] : scoped_values)
+            values[name] = value;
+    }
+    std::string expression;
+    for (auto& [name, value] : values)
+    {
+        if (name != "specs" && name != "dry_run")
+            expression += "rhumba::set_config(" + r_string(name) + ", " + r_string(value) + "); ";
+    }
+    return expression;
+}
+
+#ifndef _WIN32
+extern char** environ;
+
+// Starts Rscript on an expression, with its output going to the file
+// descriptor set up by `actions`.
+pid_t spawn_rscript(const std::string& expression, posix_spawn_file_actions_t& actions)
+{
+    std::string rscript = (fs::path(get_env("R_HOME")) / "bin" / "Rscript").string();
+    std::vector<std::string> args = { rscript, "-e", expression };
+    std::vector<char*> argv;
+    for (auto& arg : args)
+        argv.push_back(&arg[0]);
+    argv.push_back(nullptr);
+
+    pid_t pid = 0;
+    int error = posix_spawn(&pid, rscript.c_str(), &actions, nullptr, argv.data(), environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (error != 0)
+        r::stop("Could not start " + rscript + ": " + std::strerror(error));
+    return pid;
+}
+
+// Starts Rscript on an expression, with its output appended to `log`.
+pid_t spawn_rscript(const std::string& expression, const fs::path& log)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, 1, log.string().c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    posix_spawn_file_actions_adddup2(&actions, 1, 2);
+    return spawn_rscript(expression, actions);
+}
+
+// Starts Rscript on an expression, with its output written to a pipe whose
+// read end is stored in `output`, for the caller to close.
+pid_t spawn_rscript_piped(const std::string& expression, int& output)
+{
+    int fds[2];
+    if (pipe(fds) != 0)
+        r::stop(std::string("Could not create a pipe: ") + std::strerror(errno));
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], 1);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], 2);
+    pid_t pid;
+    try
+    {
+        pid = spawn_rscript(expression, actions);
+    }
+    catch (...)
+    {
+        close(fds[0]);
+        close(fds[1]);
+        throw;
+    }
+    close(fds[1]);
+    output = fds[0];
+    return pid;
+}
+
+pid_t refresher_pid = 0;
+#endif
+
+// Statistics libsolv prints while solving at verbosity 4, NA where the
+// output has none. libsolv logs every decision it propagates, and a
+// "learned rule for level" line each time it backtracks from a conflict;
+// the header of the analysis before it is not counted.
+struct SolverStats
+{
+    double rules = NA_REAL;
+    double decisions = NA_REAL;
+    double backtracks = NA_REAL;
+    double learned_rules = NA_REAL;
+    double unsolvable = NA_REAL;
+    double minimization_steps = NA_REAL;
+    double solver_ms = NA_REAL;
+};
+
+// What happened to the last install, create, update or remove, for
+// solve_report().
+struct SolveReport
+{
+    std::string command;
+    std::vector<std::string> specs;
+    std::string status = "none";
+    double seconds = 0;
+    double solve_seconds = NA_REAL;
+    double timeout = NA_REAL;
+    double iterations = NA_REAL;
+    double held = 0;
+    SolverStats stats;
+    std::string output;
+    std::vector<std::string> problems;
+    std::vector<SolveConflict> conflicts;
+    std::vector<std::string> candidates;
+};
+
+SolveReport last_solve;
+
+// The indented lines libmamba lists under "Encountered problems while
+// solving", up to the next blank line.
+std::vector<std::string> solver_problems(const std::string& output)
+{
+    std::vector<std::string> problems;
+    std::size_t start = output.find("Encountered problems while solving");
+    if (start == std::string::npos)
+        start = output.find("Could not solve");
+    if (start == std::string::npos)
+        return problems;
+
+    std::size_t pos = output.find('\n', start);
+    while (pos != std::string::npos && pos + 1 < output.size())
+    {
+        std::size_t end = output.find('\n', pos + 1);
+        std::string line = output.substr(pos + 1, end == std::string::npos ? std::string::npos : end - pos - 1);
+        line.erase(line.find_last_not_of(" \r") + 1);
+        if (line.empty())
+            break;
+        std::size_t text = line.find_first_not_of(" -");
+        if (text != std::string::npos)
+            problems.push_back(line.substr(text));
+        pos = end;
+    }
+    return problems;
+}
+
+// The problems libmamba printed in `output`, parsed as for solve_report().
+// [[Rcpp::export(.parse_problems)]]
+r::DataFrame parse_problems(const std::string& output)
+{
+    std::vector<std::string> types, packages, requirements, conflicts_with, texts;
+    for (auto& problem : solver_problems(output))
+    {
+        SolveConflict conflict = parse_problem(problem);
+        types.push_back(conflict.type);
+        packages.push_back(conflict.package);
+        requirements.push_back(conflict.requirement);
+        conflicts_with.push_back(conflict.conflicts_with);
+        texts.push_back(conflict.text);
+    }
+    return r::DataFrame::create(r::Named("type") = types,
+                                r::Named("package") = packages,
+                                r::Named("requirement") = requirements,
+                                r::Named("conflicts_with") = conflicts_with,
+                                r::Named("text") = texts,
+                                r::Named("stringsAsFactors") = false);
+}
+
+// Fills in the last report from the output of the operation, parsed once
+// here so that a failure can be diagnosed without solving again.
+// `stopped` is "timeout" or "iterations" when the solve went over that
+// budget.
+void record_outcome(const std::string& output, int status, const std::string& stopped, bool warn)
+{
+    last_solve.output = output;
+    last_solve.problems = solver_problems(output);
+    for (auto& problem : last_solve.problems)
+        last_solve.conflicts.push_back(parse_problem(problem));
+    last_solve.status = !stopped.empty() ? stopped : (status == 0 ? "ok" : "failed");
+    if (!warn)
+        return;
+    if (stopped == "timeout")
+        r::warning("The solver did not finish within solve_timeout (" + std::to_string(static_cast<long long>(last_solve.timeout))
+                   + " s) and was stopped before changing anything, see solve_report()");
+    else if (stopped == "iterations")
+        r::warning("The solver backtracked more than solve_iterations ("
+                   + std::to_string(static_cast<long long>(last_solve.iterations))
+                   + " times) and was stopped before changing anything, see solve_report()");
+    else if (status != 0 && !last_solve.conflicts.empty())
+        r::warning(last_solve.command + " failed, the solver reported " + std::to_string(last_solve.conflicts.size())
+                   + " problems, see solve_report()$conflicts");
+}
+
+// The libmamba call behind an operation of run_solve().
+int call_mamba(const std::string& operation, int all)
+{
+    if (operation == "create")
+        return mamba_create();
+    if (operation == "update")
+        return mamba_update(all);
+    if (operation == "remove")
+        return mamba_remove(all);
+    return mamba_install();
+}
+
+// Set while libmamba installs an explicit list of packages, which involves
+// no solve to budget.
+bool explicit_install = false;
+
+class ExplicitInstall
+{
+public:
+    explicit ExplicitInstall(const fs::path& file)
+    {
+        mamba_clear_config("specs");
+        mamba_set_cli_config("file_specs", file.string().c_str());
+        explicit_install = true;
+    }
+
+    ~ExplicitInstall()
+    {
+        mamba_clear_config("file_specs");
+        explicit_install = false;
+    }
+
+    ExplicitInstall(const ExplicitInstall&) = delete;
+    ExplicitInstall& operator=(const ExplicitInstall&) = delete;
+};
+
+// A numeric rhumba setting, 0 when it is not set.
+double setting_number(const char* name)
+{
+    auto it = config_values.find(name);
+    return it == config_values.end() ? 0 : std::atof(it->second.c_str());
+}
+
+// Updates the statistics from one line of solver output.
+void add_solver_line(const std::string& line, SolverStats& stats)
+{
+    auto count = [](double& value) { value = std::isnan(value) ? 1 : value + 1; };
+    std::size_t at;
+    int a, b, c, d, e, f, g, h;
+    if (line.find("propagate decision ") != std::string::npos)
+        count(stats.decisions);
+    else if (line.find("learned rule for level ") != std::string::npos)
+        count(stats.backtracks);
+    else if ((at = line.find(" pkg rules, 2 * ")) != std::string::npos)
+    {
+        at = line.find_last_not_of("0123456789", at - 1) + 1;
+        if (std::sscanf(line.c_str() + at,
+                        "%d pkg rules, 2 * %d update rules, %d job rules, %d infarch rules, %d dup rules, %d choice rules, "
+                        "%d best rules, %d yumobs rules",
+                        &a, &b, &c, &d, &e, &f, &g, &h)
+            >= 6)
+            stats.rules = a + 2.0 * b + c + d + e + f + g + h;
+    }
+    else if ((at = line.find("solver statistics: ")) != std::string::npos)
+    {
+        if (std::sscanf(line.c_str() + at, "solver statistics: %d learned rules, %d unsolvable, %d minimization steps", &a,
+                        &b, &c)
+            == 3)
+        {
+            stats.learned_rules = a;
+            stats.unsolvable = b;
+            stats.minimization_steps = c;
+        }
+    }
+    else if ((at = line.find("solver_solve took ")) != std::string::npos)
+    {
+        if (std::sscanf(line.c_str() + at, "solver_solve took %d ms", &a) == 1)
+            stats.solver_ms = a;
+    }
+}
+
+// The statistics as solve_report() lists them.
+r::List stats_list(const SolverStats& stats)
+{
+    return r::List::create(r::Named("rules") = stats.rules,
+                           r::Named("decisions") = stats.decisions,
+                           r::Named("backtracks") = stats.backtracks,
+                           r::Named("learned_rules") = stats.learned_rules,
+                           r::Named("unsolvable") = stats.unsolvable,
+                           r::Named("minimization_steps") = stats.minimization_steps,
+                           r::Named("solver_ms") = stats.solver_ms);
+}
+
+// The statistics of some lines of solver output, as budget_solve() counts
+// them.
+// [[Rcpp::export(.solver_stats)]]
+r::List solver_stats(const std::vector<std::string>& lines)
+{
+    SolverStats stats;
+    for (auto& line : lines)
+        add_solver_line(line, stats);
+    return stats_list(stats);
+}
+
+#ifndef _WIN32
+// Solves the operation as a dry run in an Rscript child with the solver
+// statistics logged, stopped once it goes over the time or backtrack
+// budget; a dry run changes nothing, so killing it is safe. The child's
+// output is read from a pipe as it comes and counted line by line. Returns
+// "timeout" or "iterations" for the budget it went over, "failed" if the
+// solve failed within it, with its output in last_solve.output, and empty
+// if it succeeded.
+std::string budget_solve(const std::string& operation, int all, double timeout, double iterations)
+{
+    auto specs = config_values.find("specs");
+    std::string expression = config_expression(true) + "rhumba:::.solve_only("
+                             + r_string(operation) + ", " + r_string(specs == config_values.end() ? "" : specs->second)
+                             + ", " + r_string(current_prefix) + ", " + std::to_string(all) + ")";
+    auto start = std::chrono::steady_clock::now();
+    int fd = -1;
+    pid_t pid = spawn_rscript_piped(expression, fd);
+    auto stop_child = [pid]() {
+        kill(pid, SIGKILL);
+        while (waitpid(pid, nullptr, 0) < 0 && errno == EINTR)
+            ;
+    };
+
+    // The propagation log can run to gigabytes: only the statistics and the
+    // end of the output are kept.
+    std::string line, tail;
+    std::string stopped;
+    int status = 0;
+    try
+    {
+        bool open = true;
+        while (open)
+        {
+            pollfd ready = { fd, POLLIN, 0 };
+            int polled = poll(&ready, 1, 100);
+            if (polled < 0 && errno != EINTR)
+                throw std::runtime_error(std::string("Could not read the solver output: ") + std::strerror(errno));
+            if (polled > 0)
+            {
+                char buffer[65536];
+                ssize_t n = read(fd, buffer, sizeof(buffer));
+                if (n < 0 && errno != EINTR && errno != EAGAIN)
+                    throw std::runtime_error(std::string("Could not read the solver output: ") + std::strerror(errno));
+                open = n != 0;
+                for (ssize_t i = 0; i < n; ++i)
+                {
+                    if (buffer[i] != '\n')
+                    {
+                        line += buffer[i];
+                        continue;
+                    }
+                    add_solver_line(line, last_solve.stats);
+                    tail += line + "\n";
+                    line.clear();
+                }
+                if (tail.size() > 65536)
+                    tail.erase(0, tail.size() - 65536);
+            }
+            double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            if (timeout > 0 && elapsed > timeout)
+                stopped = "timeout";
+            else if (iterations > 0 && last_solve.stats.backtracks > iterations)
+                stopped = "iterations";
+            if (!stopped.empty())
+            {
+                stop_child();
+                break;
+            }
+            r::checkUserInterrupt();
+        }
+        if (stopped.empty())
+        {
+            while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+                ;
+        }
+    }
+    catch (...)
+    {
+        stop_child();
+        close(fd);
+        throw;
+    }
+    close(fd);
+    last_solve.solve_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    last_solve.output = tail + line;
+    if (!stopped.empty())
+        return stopped;
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+        return "";
+
+    // Without a solve, the child could not run it at all, e.g. because this
+    // build of rhumba is not the one installed for Rscript. Solving without
+    // the budget that was asked for could run away, so this is an error.
+    if (std::isnan(last_solve.stats.rules) && std::isnan(last_solve.stats.solver_ms))
+        r::stop("Could not run the budgeted solve in a separate Rscript process, is rhumba installed for Rscript?\n"
+                + last_solve.output);
+    return "failed";
+}
+#endif
+
+std::map<std::string, std::string> index_load_formats();
+void record_index_loads(const std::map<std::string, std::string>& formats);
+
+// Runs a libmamba operation: "install", "create", "update" or "remove",
+// with `all` for the latter two. With set_config("solve_timeout", seconds)
+// or set_config("solve_iterations", backtracks), the solve runs first as a
+// dry run in an Rscript child, stopped if it goes over the budget. Only a
+// solve that fits and succeeds goes on to run here, where nothing interrupts
+// the transaction; a failed one is reported from the child's output. `warn` is false for attempts a caller retries on failure.
+// The output is always teed, so that the problems of a failed solve are
+// parsed for solve_report() without running the solver again.
+int run_solve(const std::string& command, const std::vector<std::string>& specs, const std::string& operation, int all = 0,
+              bool warn = true)
+{
+    last_solve = SolveReport();
+    last_solve.command = command;
+    last_solve.specs = specs;
+    auto start = std::chrono::steady_clock::now();
+
+    double timeout = setting_number("solve_timeout");
+    double iterations = setting_number("solve_iterations");
+#ifndef _WIN32
+    if (!explicit_install && (timeout > 0 || iterations > 0))
+    {
+        last_solve.timeout = timeout > 0 ? timeout : NA_REAL;
+        last_solve.iterations = iterations > 0 ? iterations : NA_REAL;
+        std::string stopped = budget_solve(operation, all, timeout, iterations);
+        if (!stopped.empty())
+        {
+            last_solve.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            record_outcome(last_solve.output, 1, stopped == "failed" ? "" : stopped, warn);
+            return 1;
+        }
+    }
+#endif
+
+    std::map<std::string, std::string> formats;
+    if (!explicit_install)
+        formats = index_load_formats();
+    OutputTee tee;
+    int status = call_mamba(operation, all);
+    std::string output = tee.finish();
+    record_index_loads(formats);
+    last_solve.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    record_outcome(output, status, "", warn);
+    return status;
+}
+
+// Solves an operation of run_solve() as a dry run in this process, for the
+// budgeted solve of another. Takes no locks: the caller holds them.
+// [[Rcpp::export(.solve_only)]]
+void solve_only(const char* operation, const char* specs, const char* prefix, int all)
 {
     mamba_use_conda_root_prefix();
     hide_banner();
-    set_specs(specs);
+    set_config("dry_run", "true");
+    set_config("always_yes", "true");
+    set_config("verbose", "4");
+    set_config("specs", specs);
     set_prefix(prefix);
-    mamba_remove(remove_all);
+    if (call_mamba(operation, all) != 0)
+        r::stop(std::string(operation) + " failed");
 }
 
-// [[Rcpp::export]]
-void info(const char* prefix = "")
+std::string daemon_socket;
+
+#ifndef _WIN32
+int open_socket(const std::string& path, sockaddr_un& address)
 {
-    mamba_use_conda_root_prefix();
-    set_prefix(prefix);
-    mamba_info();
+    if (path.size() >= sizeof(address.sun_path))
+        r::stop("Socket path " + path + " is too long");
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        r::stop("Could not create a socket");
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    std::strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+    return fd;
+}
+
+bool send_line(int fd, const std::string& message)
+{
+    std::string line = message + "\n";
+    std::size_t sent = 0;
+    while (sent < line.size())
+    {
+        ssize_t n = send(fd, line.data() + sent, line.size() - sent, 0);
+        if (n <= 0)
+            return false;
+        sent += n;
+    }
+    return true;
+}
+
+// Reads the request line of a connection, the only line a client sends, so
+// whatever follows the newline is dropped. Fails on timeouts set with
+// SO_RCVTIMEO.
+bool receive_line(int fd, std::string& line)
+{
+    line.clear();
+    char buffer[1 << 16];
+    while (line.size() < (std::size_t(1) << 28))
+    {
+        ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+        if (n <= 0)
+            return false;
+        const char* end = static_cast<const char*>(std::memchr(buffer, '\n', n));
+        line.append(buffer, end ? end - buffer : n);
+        if (end)
+            return true;
+    }
+    return false;
+}
+
+// Environment variables libmamba reads (condarc, proxies, certificates),
+// which a request runs with instead of the daemon's own.
+bool forwarded_variable(const std::string& name)
+{
+    static const std::unordered_set<std::string> names = {
+        "CONDARC", "MAMBARC", "HTTP_PROXY", "HTTPS_PROXY", "NO_PROXY", "ALL_PROXY", "http_proxy",
+        "https_proxy", "no_proxy", "all_proxy", "REQUESTS_CA_BUNDLE", "SSL_CERT_FILE", "SSL_CERT_DIR"
+    };
+    for (const char* prefix : { "MAMBA_", "CONDA_", "RHUMBA_" })
+    {
+        if (name.rfind(prefix, 0) == 0)
+            return true;
+    }
+    return names.count(name) > 0;
+}
+
+std::map<std::string, std::string> forwarded_environment()
+{
+    std::map<std::string, std::string> variables;
+    for (char** entry = environ; *entry; ++entry)
+    {
+        std::string variable = *entry;
+        std::size_t eq = variable.find('=');
+        if (eq != std::string::npos && forwarded_variable(variable.substr(0, eq)))
+            variables[variable.substr(0, eq)] = variable.substr(eq + 1);
+    }
+    return variables;
+}
+
+// Replaces the forwarded variables of this process by a client's for the
+// duration of a request.
+class ScopedEnvironment
+{
+public:
+    explicit ScopedEnvironment(const std::map<std::string, std::string>& variables)
+        : m_saved(forwarded_environment())
+    {
+        apply(variables);
+    }
+
+    ~ScopedEnvironment()
+    {
+        apply(m_saved);
+    }
+
+    ScopedEnvironment(const ScopedEnvironment&) = delete;
+    ScopedEnvironment& operator=(const ScopedEnvironment&) = delete;
+
+private:
+    static void apply(const std::map<std::string, std::string>& variables)
+    {
+        for (auto& [name, value] : forwarded_environment())
+        {
+            if (!variables.count(name))
+                unsetenv(name.c_str());
+        }
+        for (auto& [name, value] : variables)
+        {
+            if (forwarded_variable(name))
+                setenv(name.c_str(), value.c_str(), 1);
+        }
+    }
+
+    std::map<std::string, std::string> m_saved;
+};
+#endif
+
+// Runs a command in the daemon configured with use_daemon(), forwarding the
+// configuration of this session and printing the daemon's output here as it
+// arrives. An interrupt only stops the waiting: the daemon runs the request
+// to its end, as a transaction is never cut short.
+void delegate(json request)
+{
+#ifdef _WIN32
+    r::stop("The rhumba daemon is not supported on Windows");
+#else
+    // The daemon runs in its own directory and environment.
+    request["config"] = config_values;
+    request["environment"] = forwarded_environment();
+    if (request.contains("prefix"))
+        request["prefix"] = resolve_prefix(request["prefix"].get<std::string>()).string();
+
+    sockaddr_un address;
+    int fd = open_socket(daemon_socket, address);
+    if (connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0)
+    {
+        close(fd);
+        r::stop("Could not connect to the rhumba daemon at " + daemon_socket);
+    }
+
+    // The output comes as {"output": ...} lines, the last line also has the
+    // status.
+    json reply;
+    std::string output, pending;
+    try
+    {
+        bool open = send_line(fd, request.dump());
+        while (open && reply.is_null())
+        {
+            pollfd ready = { fd, POLLIN, 0 };
+            int polled = poll(&ready, 1, 100);
+            open = polled >= 0 || errno == EINTR;
+            if (polled > 0)
+            {
+                char buffer[1 << 16];
+                ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+                open = n > 0 || (n < 0 && errno == EINTR);
+                if (n > 0)
+                    pending.append(buffer, n);
+                std::size_t end;
+                while (reply.is_null() && (end = pending.find('\n')) != std::string::npos)
+                {
+                    json message = json::parse(pending.substr(0, end));
+                    pending.erase(0, end + 1);
+                    std::string chunk = message.value("output", "");
+                    r::Rcout << chunk << std::flush;
+                    output += chunk;
+                    if (message.contains("status"))
+                        reply = std::move(message);
+                }
+            }
+            r::checkUserInterrupt();
+        }
+    }
+    catch (...)
+    {
+        close(fd);
+        throw;
+    }
+    close(fd);
+    if (reply.is_null())
+        r::stop("The rhumba daemon at " + daemon_socket + " closed the connection");
+
+    if (reply.contains("report"))
+    {
+        // NA timings come back as null.
+        auto number = [](const json& value) { return value.is_number() ? value.get<double>() : NA_REAL; };
+        const json& report = reply["report"];
+        last_solve = SolveReport();
+        last_solve.command = report.value("command", "");
+        last_solve.specs = report.value("specs", std::vector<std::string>{});
+        last_solve.status = report.value("status", "none");
+        last_solve.seconds = number(report.value("seconds", json()));
+        last_solve.solve_seconds = number(report.value("solve_seconds", json()));
+        last_solve.timeout = number(report.value("timeout", json()));
+        last_solve.iterations = number(report.value("iterations", json()));
+        last_solve.held = report.value("held", 0.0);
+        const json stats = report.value("stats", json::object());
+        last_solve.stats.rules = number(stats.value("rules", json()));
+        last_solve.stats.decisions = number(stats.value("decisions", json()));
+        last_solve.stats.backtracks = number(stats.value("backtracks", json()));
+        last_solve.stats.learned_rules = number(stats.value("learned_rules", json()));
+        last_solve.stats.unsolvable = number(stats.value("unsolvable", json()));
+        last_solve.stats.minimization_steps = number(stats.value("minimization_steps", json()));
+        last_solve.stats.solver_ms = number(stats.value("solver_ms", json()));
+        last_solve.problems = report.value("problems", std::vector<std::string>{});
+        last_solve.output = output;
+        for (auto& problem : last_solve.problems)
+            last_solve.conflicts.push_back(parse_problem(problem));
+        last_solve.candidates = report.value("candidates", std::vector<std::string>{});
+    }
+    if (reply.value("status", 1) != 0)
+        r::stop(reply.value("error", "The rhumba daemon failed to run " + request.value("command", "")));
+#endif
+}
+
+struct PathEntry
+{
+    std::string path;
+    std::string path_type;
+    std::string sha256;
+    std::string prefix_placeholder;
+    std::string file_mode;
+    std::size_t size = 0;
+};
+
+struct PrefixRecord
+{
+    std::string name;
+    std::string version;
+    std::string build;
+    std::string channel;
+    std::string url;
+    std::string fn;
+    std::vector<std::string> depends;
+    std::vector<PathEntry> paths;
+};
+
+std::vector<PrefixRecord> read_prefix_records(const fs::path& prefix)
+{
+    std::vector<PrefixRecord> records;
+    fs::path conda_meta = prefix / "conda-meta";
+    if (!fs::exists(conda_meta))
+        return records;
+
+    for (auto& entry : fs::directory_iterator(conda_meta))
+    {
+        if (entry.path().extension() != ".json")
+            continue;
+
+        std::ifstream in(entry.path().string());
+        json j = json::parse(in);
+
+        PrefixRecord rec;
+        rec.name = j.value("name", "");
+        rec.version = j.value("version", "");
+        rec.build = j.value("build", "");
+        rec.channel = j.value("channel", "");
+        rec.url = j.value("url", "");
+        rec.fn = j.value("fn", "");
+        if (j.contains("depends"))
+            rec.depends = j["depends"].get<std::vector<std::string>>();
+
+        if (j.contains("paths_data"))
+        {
+            for (auto& p : j["paths_data"]["paths"])
+            {
+                PathEntry path;
+                path.path = p.value("_path", "");
+                path.path_type = p.value("path_type", "hardlink");
+                path.sha256 = p.value("sha256_in_prefix", p.value("sha256", ""));
+                path.prefix_placeholder = p.value("prefix_placeholder", "");
+                path.file_mode = p.value("file_mode", "text");
+                path.size = p.value("size_in_bytes", std::size_t(0));
+                rec.paths.push_back(path);
+            }
+        }
+        records.push_back(std::move(rec));
+    }
+
+    std::sort(records.begin(), records.end(), [](const PrefixRecord& a, const PrefixRecord& b) {
+        return a.name < b.name;
+    });
+    return records;
+}
+
+// One block of conda-meta/history: the packages a transaction linked and
+// unlinked, as channel::name-version-build, and the specs it was asked for,
+// e.g. { "update", { "r-base >=4" } }.
+struct HistoryRevision
+{
+    std::string date;
+    std::string command;
+    std::vector<std::string> added;
+    std::vector<std::string> removed;
+    std::vector<std::pair<std::string, std::vector<std::string>>> requests;
+};
+
+// The quoted items of a specs list, ["a", "b >=1,<2"] or ['a'].
+std::vector<std::string> history_specs(const std::string& list)
+{
+    std::vector<std::string> specs;
+    std::size_t pos = 0;
+    while ((pos = list.find_first_of("'\"", pos)) != std::string::npos)
+    {
+        std::size_t end = list.find(list[pos], pos + 1);
+        if (end == std::string::npos)
+            break;
+        specs.push_back(list.substr(pos + 1, end - pos - 1));
+        pos = end + 1;
+    }
+    return specs;
+}
+
+std::vector<HistoryRevision> read_history(const fs::path& prefix)
+{
+    std::vector<HistoryRevision> revisions;
+    std::ifstream in((prefix / "conda-meta" / "history").string());
+    std::string line;
+    while (std::getline(in, line))
+    {
+        line.erase(line.find_last_not_of(" \t\r") + 1);
+        if (line.compare(0, 4, "==> ") == 0 && line.size() > 8 && line.compare(line.size() - 4, 4, " <==") == 0)
+        {
+            revisions.emplace_back();
+            revisions.back().date = line.substr(4, line.size() - 8);
+            continue;
+        }
+        if (revisions.empty() || line.empty())
+            continue;
+
+        HistoryRevision& revision = revisions.back();
+        if (line[0] == '+')
+            revision.added.push_back(line.substr(1));
+        else if (line[0] == '-')
+            revision.removed.push_back(line.substr(1));
+        else if (line.compare(0, 7, "# cmd: ") == 0)
+            revision.command = line.substr(7);
+        else if (line.compare(0, 2, "# ") == 0)
+        {
+            std::size_t colon = line.find(" specs: ");
+            if (colon != std::string::npos)
+                revision.requests.emplace_back(line.substr(2, colon - 2), history_specs(line.substr(colon + 8)));
+        }
+    }
+    return revisions;
+}
+
+std::string read_file(const fs::path& path)
+{
+    std::ifstream in(path.string(), std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+void write_file(const fs::path& path, const std::string& data)
+{
+    std::ofstream out(path.string(), std::ios::binary | std::ios::trunc);
+    out << data;
+}
+
+// A file of its own in the temporary directory, created empty and removed
+// when it goes out of scope, so that concurrent sessions never share one.
+class TempFile
+{
+public:
+    TempFile(const std::string& prefix, const std::string& extension)
+    {
+        std::random_device random;
+        for (int attempt = 0; attempt < 100; ++attempt)
+        {
+            char suffix[17];
+            std::snprintf(suffix, sizeof(suffix), "%08x%08x", random(), random());
+            m_path = fs::temp_directory_path() / (prefix + std::to_string(getpid()) + "-" + suffix + extension);
+            int fd = open(m_path.string().c_str(), O_WRONLY | O_CREAT | O_EXCL, 0600);
+            if (fd >= 0)
+            {
+                close(fd);
+                return;
+            }
+            if (errno != EEXIST)
+                break;
+        }
+        r::stop("Could not create a temporary file " + m_path.string() + ": " + std::strerror(errno));
+    }
+
+    ~TempFile()
+    {
+        std::error_code ec;
+        fs::remove(m_path, ec);
+    }
+
+    TempFile(const TempFile&) = delete;
+    TempFile& operator=(const TempFile&) = delete;
+
+    const fs::path& path() const
+    {
+        return m_path;
+    }
+
+private:
+    fs::path m_path;
+};
+
+// Read-only view of a whole file, memory-mapped where the platform allows.
+// Used from worker threads, so failures throw std::runtime_error.
+class MappedFile
+{
+public:
+    explicit MappedFile(const fs::path& path)
+    {
+#ifdef _WIN32
+        m_buffer = read_file(path);
+        m_data = m_buffer.data();
+        m_size = m_buffer.size();
+#else
+        int fd = open(path.string().c_str(), O_RDONLY);
+        if (fd < 0)
+            throw std::runtime_error("Could not open " + path.string());
+        struct stat st = {};
+        if (fstat(fd, &st) == 0 && st.st_size > 0)
+        {
+            void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data != MAP_FAILED)
+            {
+                m_data = static_cast<const char*>(data);
+                m_size = st.st_size;
+                m_mapped = true;
+            }
+        }
+        close(fd);
+        if (!m_mapped && st.st_size > 0)
+            throw std::runtime_error("Could not map " + path.string());
+#endif
+    }
+
+    ~MappedFile()
+    {
+#ifndef _WIN32
+        if (m_mapped)
+            munmap(const_cast<char*>(m_data), m_size);
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* data() const
+    {
+        return m_data;
+    }
+
+    std::size_t size() const
+    {
+        return m_size;
+    }
+
+private:
+    const char* m_data = "";
+    std::size_t m_size = 0;
+    bool m_mapped = false;
+#ifdef _WIN32
+    std::string m_buffer;
+#endif
+};
+
+json parse_json_file(const fs::path& path)
+{
+    MappedFile file(path);
+    return json::parse(file.data(), file.data() + file.size());
+}
+
+// Whether the prefix found at `pos` is a whole path, and not part of a
+// longer one such as <prefix>2 or /other<prefix>.
+bool prefix_boundary(const std::string& data, std::size_t pos, std::size_t size)
+{
+    auto path_char = [](char c) {
+        return std::isalnum(static_cast<unsigned char>(c)) || (c != '\0' && std::strchr("._-+@~", c));
+    };
+    std::size_t end = pos + size;
+    if (end < data.size() && path_char(data[end]))
+        return false;
+    return pos == 0 || (!path_char(data[pos - 1]) && data[pos - 1] != '/' && data[pos - 1] != '\\');
+}
+
+// Files listed with a prefix placeholder had it replaced by the source prefix
+// at link time, so they have to be rewritten instead of linked.
+void rewrite_prefix(const fs::path& src, const fs::path& dst, const PathEntry& entry,
+                    const std::string& old_prefix, const std::string& new_prefix)
+{
+    std::string data = read_file(src);
+    std::size_t pos = 0;
+    if (entry.file_mode == "binary")
+    {
+        while ((pos = data.find(old_prefix, pos)) != std::string::npos)
+        {
+            if (!prefix_boundary(data, pos, old_prefix.size()))
+            {
+                pos += old_prefix.size();
+                continue;
+            }
+            std::size_t end = data.find('\0', pos);
+            if (end == std::string::npos)
+                end = data.size();
+            std::string replaced = new_prefix + data.substr(pos + old_prefix.size(), end - pos - old_prefix.size());
+            replaced.resize(end - pos, '\0');
+            data.replace(pos, end - pos, replaced);
+            pos = end;
+        }
+    }
+    else
+    {
+        while ((pos = data.find(old_prefix, pos)) != std::string::npos)
+        {
+            if (!prefix_boundary(data, pos, old_prefix.size()))
+            {
+                pos += old_prefix.size();
+                continue;
+            }
+            data.replace(pos, old_prefix.size(), new_prefix);
+            pos += new_prefix.size();
+        }
+    }
+    write_file(dst, data);
+    fs::permissions(dst, fs::status(src).permissions());
+}
+
+bool link_or_copy(const fs::path& src, const fs::path& dst)
+{
+    std::error_code ec;
+    fs::create_hard_link(src, dst, ec);
+    if (!ec)
+        return true;
+    fs::copy_file(src, dst, fs::copy_options::overwrite_existing);
+    return false;
+}
+
+void copy_entry(const fs::path& src, const fs::path& dst)
+{
+    fs::create_directories(dst.parent_path());
+    if (fs::is_symlink(src))
+        fs::copy_symlink(src, dst);
+    else if (fs::is_directory(src))
+        fs::create_directories(dst);
+    else
+        fs::copy_file(src, dst, fs::copy_options::overwrite_existing);
+}
+
+void clone_prefix(const fs::path& src, const fs::path& dst)
+{
+    std::string old_prefix = src.string();
+    std::string new_prefix = dst.string();
+    std::unordered_set<std::string> done;
+    std::size_t linked = 0, copied = 0, rewritten = 0;
+
+    auto records = read_prefix_records(src);
+    if (new_prefix.size() > old_prefix.size())
+    {
+        for (auto& rec : records)
+            for (auto& entry : rec.paths)
+                if (!entry.prefix_placeholder.empty() && entry.file_mode == "binary")
+                    r::stop("Cannot clone into " + new_prefix + ": binary file " + entry.path
+                            + " needs a prefix at most " + std::to_string(old_prefix.size()) + " characters long");
+    }
+
+    fs::create_directories(dst);
+    for (auto& rec : records)
+    {
+        for (auto& entry : rec.paths)
+        {
+            fs::path from = src / entry.path;
+            fs::path to = dst / entry.path;
+            if (!fs::exists(fs::symlink_status(from)))
+                continue;
+
+            fs::create_directories(to.parent_path());
+            if (fs::is_symlink(from) || fs::is_directory(from))
+            {
+                copy_entry(from, to);
+                ++copied;
+            }
+            else if (!entry.prefix_placeholder.empty())
+            {
+                rewrite_prefix(from, to, entry, old_prefix, new_prefix);
+                ++rewritten;
+            }
+            else if (link_or_copy(from, to))
+            {
+                ++linked;
+            }
+            else
+            {
+                ++copied;
+            }
+            done.insert(fs::path(entry.path).lexically_normal().generic_string());
+        }
+    }
+
+    // conda-meta and whatever post-link scripts created are not tracked by
+    // the records, copy them so that the clone owns its own metadata.
+    for (auto it = fs::recursive_directory_iterator(src); it != fs::recursive_directory_iterator(); ++it)
+    {
+        fs::path rel = it->path().lexically_relative(src);
+        if (done.count(rel.generic_string()) || fs::exists(fs::symlink_status(dst / rel)))
+            continue;
+        copy_entry(it->path(), dst / rel);
+        if (fs::is_symlink(it->path()))
+            it.disable_recursion_pending();
+        else if (!fs::is_directory(it->path()))
+            ++copied;
+    }
+
+    r::Rcout << "Cloned " << src.string() << " into " << dst.string() << ": "
+             << linked << " hardlinked, " << rewritten << " rewritten, " << copied << " copied" << std::endl;
+}
+
+std::string hex_string(const unsigned char* data, std::size_t size)
+{
+    static const char* hex = "0123456789abcdef";
+    std::string result;
+    for (std::size_t i = 0; i < size; ++i)
+    {
+        result += hex[data[i] >> 4];
+        result += hex[data[i] & 0xf];
+    }
+    return result;
+}
+
+// libmamba already links libcrypto for its own checksums, so hashing goes
+// through the same OpenSSL implementation.
+class Sha256
+{
+public:
+    Sha256()
+        : m_ctx(EVP_MD_CTX_new())
+    {
+        if (!m_ctx || !EVP_DigestInit_ex(m_ctx, EVP_sha256(), nullptr))
+            throw std::runtime_error("Could not initialize sha256");
+    }
+
+    ~Sha256()
+    {
+        EVP_MD_CTX_free(m_ctx);
+    }
+
+    Sha256(const Sha256&) = delete;
+    Sha256& operator=(const Sha256&) = delete;
+
+    void update(const char* data, std::size_t size)
+    {
+        EVP_DigestUpdate(m_ctx, data, size);
+    }
+
+    void update(const std::string& data)
+    {
+        update(data.data(), data.size());
+    }
+
+    std::string hexdigest()
+    {
+        unsigned char digest[EVP_MAX_MD_SIZE];
+        unsigned int size = 0;
+        EVP_DigestFinal_ex(m_ctx, digest, &size);
+        return hex_string(digest, size);
+    }
+
+private:
+    EVP_MD_CTX* m_ctx;
+};
+
+std::string md5_hex(const std::string& data)
+{
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int size = 0;
+    EVP_Digest(data.data(), data.size(), digest, &size, EVP_md5(), nullptr);
+    return hex_string(digest, size);
+}
+
+std::string sha256_file(const fs::path& path)
+{
+    Sha256 hash;
+    std::ifstream in(path.string(), std::ios::binary);
+    std::vector<char> buffer(1 << 16);
+    while (in.read(buffer.data(), buffer.size()) || in.gcount())
+        hash.update(buffer.data(), in.gcount());
+    return hash.hexdigest();
+}
+
+// Files of a prefix that are missing or whose content no longer matches the
+// sha256 recorded when they were linked.
+std::vector<std::string> verify_prefix(const fs::path& prefix)
+{
+    std::vector<std::string> broken;
+    for (auto& rec : read_prefix_records(prefix))
+    {
+        for (auto& entry : rec.paths)
+        {
+            fs::path path = prefix / entry.path;
+            std::error_code ec;
+            if (!fs::exists(fs::symlink_status(path)))
+                broken.push_back(entry.path);
+            else if (entry.path_type != "hardlink" || !entry.prefix_placeholder.empty())
+                continue;
+            else if (entry.size && fs::file_size(path, ec) != entry.size)
+                broken.push_back(entry.path);
+            else if (entry.sha256.size() == 64 && sha256_file(path) != entry.sha256)
+                broken.push_back(entry.path);
+        }
+    }
+    return broken;
+}
+
+// Shared store: files are kept once under objects/ keyed by their sha256 and
+// hardlinked into every prefix using them. Linked files share one inode, so
+// editing one in place changes it in every prefix linked to the store.
+std::string shared_store;
+
+fs::path store_root(const std::string& store)
+{
+    std::string path = store.empty() ? shared_store : store;
+    if (path.empty())
+        r::stop("No shared store configured, call use_store() first");
+    return path;
+}
+
+fs::path store_object(const fs::path& store, const std::string& sha256, bool executable)
+{
+    return store / "objects" / sha256.substr(0, 2) / (sha256.substr(2) + (executable ? "-x" : ""));
+}
+
+fs::path store_prefixes_file(const fs::path& store)
+{
+    return store / "prefixes.txt";
+}
+
+std::vector<fs::path> store_prefixes(const fs::path& store)
+{
+    std::vector<fs::path> prefixes;
+    std::ifstream in(store_prefixes_file(store).string());
+    std::string line;
+    while (std::getline(in, line))
+    {
+        if (!line.empty() && std::find(prefixes.begin(), prefixes.end(), line) == prefixes.end())
+            prefixes.push_back(line);
+    }
+    return prefixes;
+}
+
+void register_store_prefix(const fs::path& store, const fs::path& prefix)
+{
+    auto prefixes = store_prefixes(store);
+    if (std::find(prefixes.begin(), prefixes.end(), prefix) != prefixes.end())
+        return;
+    std::ofstream out(store_prefixes_file(store).string(), std::ios::app);
+    out << prefix.string() << "\n";
+}
+
+// How many files of the prefixes linked to the store point at each object.
+// Hard link counts cannot be used for this: objects also share their inode
+// with the extracted package in pkgs/ that libmamba linked the prefix from.
+std::map<std::string, std::size_t> store_references(const fs::path& store)
+{
+    std::map<std::string, std::size_t> references;
+    for (auto& prefix : store_prefixes(store))
+    {
+        if (!fs::exists(prefix / "conda-meta"))
+            continue;
+        for (auto& rec : read_prefix_records(prefix))
+        {
+            for (auto& entry : rec.paths)
+            {
+                if (entry.path_type != "hardlink" || !entry.prefix_placeholder.empty() || entry.sha256.size() != 64)
+                    continue;
+                fs::path file = prefix / entry.path;
+                std::error_code ec;
+                for (bool executable : { false, true })
+                {
+                    fs::path object = store_object(store, entry.sha256, executable);
+                    if (fs::equivalent(file, object, ec))
+                    {
+                        ++references[object.string()];
+                        break;
+                    }
+                }
+            }
+        }
+    }
+    return references;
+}
+
+struct StoreLinkStats
+{
+    std::size_t linked = 0;
+    std::size_t added = 0;
+    std::size_t skipped = 0;
+    uintmax_t bytes_saved = 0;
+};
+
+StoreLinkStats link_prefix_to_store(const fs::path& prefix, const fs::path& store)
+{
+    StoreLinkStats stats;
+    register_store_prefix(store, prefix);
+    for (auto& rec : read_prefix_records(prefix))
+    {
+        for (auto& entry : rec.paths)
+        {
+            fs::path file = prefix / entry.path;
+            std::error_code ec;
+            if (entry.path_type != "hardlink" || !entry.prefix_placeholder.empty() || entry.sha256.size() != 64
+                || !fs::is_regular_file(fs::symlink_status(file)) || fs::file_size(file, ec) != entry.size)
+            {
+                ++stats.skipped;
+                continue;
+            }
+
+            auto perms = fs::status(file).permissions();
+            bool executable = (perms & fs::perms::owner_exec) != fs::perms::none;
+            fs::path object = store_object(store, entry.sha256, executable);
+
+            if (!fs::exists(object))
+            {
+                // Only trust the recorded hash for content entering the store.
+                if (sha256_file(file) != entry.sha256)
+                {
+                    ++stats.skipped;
+                    continue;
+                }
+                fs::create_directories(object.parent_path());
+                fs::create_hard_link(file, object, ec);
+                if (ec)
+                    ++stats.skipped;
+                else
+                    ++stats.added;
+                continue;
+            }
+
+            if (fs::equivalent(file, object, ec) || fs::file_size(object, ec) != entry.size)
+                continue;
+
+            fs::path tmp = file;
+            tmp += ".rhumba-tmp";
+            fs::create_hard_link(object, tmp, ec);
+            if (ec)
+            {
+                ++stats.skipped;
+                continue;
+            }
+            fs::rename(tmp, file);
+            ++stats.linked;
+            stats.bytes_saved += entry.size;
+        }
+    }
+    return stats;
+}
+
+void link_to_shared_store(const char* prefix)
+{
+    if (shared_store.empty())
+        return;
+    FileLock lock(fs::path(shared_store) / "rhumba.lock", "store", false);
+    auto stats = link_prefix_to_store(resolve_prefix(prefix), shared_store);
+    r::Rcout << "Shared store: " << stats.linked << " files linked, " << stats.added << " added" << std::endl;
+}
+
+fs::path templates_file()
+{
+    return rhumba_dir() / "templates.json";
+}
+
+// Taken exclusively to change the registry, shared to read it and clone a
+// template, so that a template cannot be re-registered under a running create.
+fs::path templates_lock_path()
+{
+    return rhumba_dir() / "templates.lock";
+}
+
+fs::path template_manifest_file(const std::string& name)
+{
+    return rhumba_dir() / "templates" / (md5_hex(name).substr(0, 16) + ".json");
+}
+
+json read_templates()
+{
+    fs::path path = templates_file();
+    if (!fs::exists(path))
+        return json::object();
+    std::ifstream in(path.string());
+    return json::parse(in);
+}
+
+std::int64_t mtime_count(const fs::path& path)
+{
+    return fs::last_write_time(path).time_since_epoch().count();
+}
+
+// Records and files of a template, with the size and modification time of
+// the regular ones. Taken once the content has been checked against the
+// sha256 of the records, later uses only compare against it.
+json template_manifest(const fs::path& prefix)
+{
+    json manifest = { { "prefix", prefix.string() }, { "records", json::array() }, { "files", json::object() } };
+    for (auto& file : fs::directory_iterator(prefix / "conda-meta"))
+        if (file.path().extension() == ".json")
+            manifest["records"].push_back(file.path().filename().string());
+    std::sort(manifest["records"].begin(), manifest["records"].end());
+
+    for (auto& rec : read_prefix_records(prefix))
+    {
+        for (auto& entry : rec.paths)
+        {
+            fs::path path = prefix / entry.path;
+            if (fs::is_regular_file(fs::symlink_status(path)))
+                manifest["files"][entry.path] = { fs::file_size(path), mtime_count(path) };
+            else
+                manifest["files"][entry.path] = nullptr;
+        }
+    }
+    return manifest;
+}
+
+// Files of a template that are missing or were modified since its manifest
+// was taken, and records that were added or removed.
+std::vector<std::string> template_changes(const fs::path& prefix, const json& manifest)
+{
+    std::vector<std::string> changed;
+    std::set<std::string> recorded = manifest["records"].get<std::set<std::string>>();
+    std::set<std::string> records;
+    for (auto& file : fs::directory_iterator(prefix / "conda-meta"))
+        if (file.path().extension() == ".json")
+            records.insert(file.path().filename().string());
+    for (auto& name : records)
+        if (!recorded.count(name))
+            changed.push_back("conda-meta/" + name);
+    for (auto& name : recorded)
+        if (!records.count(name))
+            changed.push_back("conda-meta/" + name);
+
+    for (auto& [file, stat] : manifest["files"].items())
+    {
+        fs::path path = prefix / file;
+        std::error_code ec;
+        if (!fs::exists(fs::symlink_status(path)))
+            changed.push_back(file);
+        else if (!stat.is_null()
+                 && (fs::file_size(path, ec) != stat[0].get<std::uintmax_t>()
+                     || mtime_count(path) != stat[1].get<std::int64_t>()))
+            changed.push_back(file);
+    }
+    return changed;
+}
+
+// Checks the full content of `prefix` and records its manifest under `name`.
+void verify_template(const std::string& name, const fs::path& prefix)
+{
+    auto broken = verify_prefix(prefix);
+    if (!broken.empty())
+        r::stop(prefix.string() + " cannot be used as a template, " + std::to_string(broken.size())
+                + " files are missing or modified (first: " + broken.front() + ")");
+
+    fs::path manifest = template_manifest_file(name);
+    fs::create_directories(manifest.parent_path());
+    write_file(manifest.string() + ".tmp", template_manifest(prefix).dump());
+    fs::rename(manifest.string() + ".tmp", manifest);
+}
+
+// The prefix registered under `name`, to be locked by the caller before
+// check_template() looks at it.
+fs::path registered_template(const std::string& name)
+{
+    json registry = read_templates();
+    if (!registry.contains(name))
+        r::stop("No template named " + name + ", register one with register_template()");
+    return registry[name].get<std::string>();
+}
+
+void check_template(const std::string& name, const fs::path& prefix)
+{
+    fs::path path = template_manifest_file(name);
+    json manifest;
+    if (fs::exists(path))
+        manifest = parse_json_file(path);
+    if (manifest.is_null() || manifest.value("prefix", "") != prefix.string())
+    {
+        // Registered before manifests were kept, hash it this once.
+        verify_template(name, prefix);
+        return;
+    }
+
+    auto changed = template_changes(prefix, manifest);
+    if (!changed.empty())
+        r::stop("Template " + name + " is damaged, " + std::to_string(changed.size())
+                + " files are missing or modified (first: " + changed.front() + ")");
+}
+
+std::string platform()
+{
+    auto it = config_values.find("platform");
+    if (it != config_values.end() && !it->second.empty())
+        return it->second;
+#if defined(_WIN32)
+    return "win-64";
+#elif defined(__APPLE__) && defined(__aarch64__)
+    return "osx-arm64";
+#elif defined(__APPLE__)
+    return "osx-64";
+#elif defined(__aarch64__)
+    return "linux-aarch64";
+#elif defined(__powerpc64__)
+    return "linux-ppc64le";
+#else
+    return "linux-64";
+#endif
+}
+
+fs::path solve_cache_file(const std::string& key)
+{
+    fs::path dir = rhumba_dir() / "solve-cache";
+    fs::create_directories(dir);
+    return dir / (key + ".txt");
+}
+
+// The solution is stored as an explicit spec file, which libmamba installs
+// as-is without going through the solver.
+bool store_solution(const std::string& key, const fs::path& prefix)
+{
+    std::string explicit_specs = "# rhumba solve cache\n@EXPLICIT\n";
+    for (auto& rec : read_prefix_records(prefix))
+    {
+        if (rec.url.empty())
+            return false;
+        explicit_specs += rec.url + "\n";
+    }
+    write_file(solve_cache_file(key), explicit_specs);
+    return true;
+}
+
+double solve_cache_hits = 0;
+double solve_cache_misses = 0;
+
+class ScopedConfig
+{
+public:
+    ScopedConfig(const std::string& name, const std::string& value)
+        : m_name(name)
+    {
+        auto outer = scoped_values.find(name);
+        if (outer != scoped_values.end())
+            m_outer = std::make_unique<std::string>(outer->second);
+        scoped_values[name] = value;
+        mamba_set_config(name.c_str(), value.c_str());
+    }
+
+    ~ScopedConfig()
+    {
+        if (m_outer)
+        {
+            scoped_values[m_name] = *m_outer;
+            mamba_set_config(m_name.c_str(), m_outer->c_str());
+            return;
+        }
+        scoped_values.erase(m_name);
+        auto it = config_values.find(m_name);
+        if (it != config_values.end())
+            mamba_set_config(m_name.c_str(), it->second.c_str());
+        else
+            mamba_clear_config(m_name.c_str());
+    }
+
+    ScopedConfig(const ScopedConfig&) = delete;
+    ScopedConfig& operator=(const ScopedConfig&) = delete;
+
+private:
+    std::string m_name;
+    std::unique_ptr<std::string> m_outer;
+};
+
+// Sets a value for the session as set_config() does, including what rhumba
+// derives from the configuration (e.g. solve cache keys), until destroyed.
+class SessionConfig
+{
+public:
+    SessionConfig(const std::string& name, const std::string& value)
+        : m_name(name)
+    {
+        auto it = config_values.find(name);
+        if (it != config_values.end())
+            m_previous = std::make_unique<std::string>(it->second);
+        set_config(name.c_str(), value.c_str());
+    }
+
+    ~SessionConfig()
+    {
+        if (m_previous)
+            set_config(m_name.c_str(), m_previous->c_str());
+        else
+            clear_config(m_name.c_str());
+    }
+
+    SessionConfig(const SessionConfig&) = delete;
+    SessionConfig& operator=(const SessionConfig&) = delete;
+
+private:
+    std::string m_name;
+    std::unique_ptr<std::string> m_previous;
+};
+
+std::vector<fs::path> pkgs_dirs()
+{
+    std::vector<fs::path> dirs;
+    auto it = config_values.find("pkgs_dirs");
+    if (it == config_values.end() || it->second.empty())
+        return { pkgs_dir() };
+
+    std::string value = it->second;
+    std::size_t start = 0;
+    while (start <= value.size())
+    {
+        std::size_t end = std::min(value.find(',', start), value.size());
+        if (end > start)
+            dirs.push_back(value.substr(start, end - start));
+        start = end + 1;
+    }
+    return dirs;
+}
+
+// libmamba prepends {"_url": ..., "_etag": ..., "_mod": ..., "_cache_control": ...
+// to the repodata it caches, read those without parsing the whole file.
+std::map<std::string, std::string> cache_header(const fs::path& path)
+{
+    std::ifstream in(path.string(), std::ios::binary);
+    std::string head(2048, '\0');
+    in.read(&head[0], head.size());
+    head.resize(in.gcount());
+
+    std::map<std::string, std::string> header;
+    for (const char* key : { "_url", "_etag", "_mod", "_cache_control" })
+    {
+        std::string needle = std::string("\"") + key + "\"";
+        std::size_t pos = head.find(needle);
+        if (pos == std::string::npos)
+            continue;
+        pos = head.find('"', head.find(':', pos + needle.size()));
+        if (pos == std::string::npos)
+            continue;
+
+        std::string value;
+        for (++pos; pos < head.size() && head[pos] != '"'; ++pos)
+        {
+            if (head[pos] == '\\' && pos + 1 < head.size())
+                ++pos;
+            value += head[pos];
+        }
+        header[key] = value;
+    }
+    return header;
+}
+
+struct CacheEntry
+{
+    fs::path json_file;
+    fs::path solv_file;
+    // Where the repodata is read from, the cache file itself unless it comes
+    // from a snapshot.
+    fs::path source_file;
+    std::string url;
+    std::string channel;
+    std::string subdir;
+};
+
+void set_entry_url(CacheEntry& entry, const std::string& url)
+{
+    entry.url = url;
+    std::string trimmed = url;
+    std::size_t slash = trimmed.find_last_of('/');
+    if (slash != std::string::npos && slash + 1 == trimmed.size())
+    {
+        trimmed.pop_back();
+        slash = trimmed.find_last_of('/');
+    }
+    if (slash != std::string::npos)
+    {
+        entry.subdir = trimmed.substr(slash + 1);
+        entry.channel = trimmed.substr(0, slash);
+    }
+}
+
+std::vector<CacheEntry> cache_entries()
+{
+    std::vector<CacheEntry> entries;
+    for (auto& dir : pkgs_dirs())
+    {
+        fs::path cache = dir / "cache";
+        if (!fs::exists(cache))
+            continue;
+        for (auto& file : fs::directory_iterator(cache))
+        {
+            if (file.path().extension() != ".json")
+                continue;
+
+            CacheEntry entry;
+            entry.json_file = file.path();
+            entry.solv_file = fs::path(file.path()).replace_extension(".solv");
+            entry.source_file = entry.json_file;
+            set_entry_url(entry, cache_header(file.path())["_url"]);
+            entries.push_back(entry);
+        }
+    }
+    return entries;
+}
+
+double seconds_since(fs::file_time_type time)
+{
+    return std::chrono::duration<double>(fs::file_time_type::clock::now() - time).count();
+}
+
+fs::path channel_ttls_file()
+{
+    return rhumba_dir() / "channel-ttls.json";
+}
+
+// Kept in the rhumba directory, so that every session and the index
+// refresher apply the same TTLs.
+std::map<std::string, double> read_channel_ttls()
+{
+    std::map<std::string, double> ttls;
+    if (fs::exists(channel_ttls_file()))
+        ttls = json::parse(read_file(channel_ttls_file())).get<std::map<std::string, double>>();
+    return ttls;
+}
+
+// Whether a channel url is the channel given by name or url in the settings.
+bool channel_matches(const std::string& url, std::string channel)
+{
+    while (!channel.empty() && channel.back() == '/')
+        channel.pop_back();
+    return url == channel
+           || (url.size() > channel.size() && url.compare(url.size() - channel.size(), channel.size(), channel) == 0
+               && url[url.size() - channel.size() - 1] == '/');
+}
+
+double default_repodata_ttl()
+{
+    auto it = config_values.find("local_repodata_ttl");
+    if (it != config_values.end() && !it->second.empty())
+        return std::stod(it->second);
+    return 1;
+}
+
+// TTL of a cached repodata file: the one set for its channel, else the global
+// local_repodata_ttl, where 1 means "whatever the server's max-age says".
+double repodata_ttl(const CacheEntry& entry, const std::map<std::string, double>& channel_ttls)
+{
+    for (auto& [channel, ttl] : channel_ttls)
+    {
+        if (channel_matches(entry.channel, channel))
+            return ttl;
+    }
+
+    double ttl = default_repodata_ttl();
+    if (ttl != 1)
+        return ttl;
+
+    std::string cache_control = cache_header(entry.json_file)["_cache_control"];
+    std::size_t pos = cache_control.find("max-age=");
+    if (pos == std::string::npos)
+        return 0;
+    return std::atof(cache_control.c_str() + pos + 8);
+}
+
+// libmamba only has a global TTL, which it compares with the age of every
+// cache file. Per-channel TTLs are applied by setting it between the ages of
+// the files expired under their own TTL and the others. When the ages do not
+// allow it, the younger files past it are revalidated too, which only costs
+// a conditional request each.
+class RepodataFreshness
+{
+public:
+    explicit RepodataFreshness(bool revalidate = false)
+    {
+        // libmamba downloads the repodata of all channels concurrently, under
+        // the same limit unless download_threads was set explicitly.
+        auto threads = config_values.find("repodata_threads");
+        if (threads != config_values.end() && !config_values.count("download_threads"))
+            m_downloads = std::make_unique<ScopedConfig>("download_threads", threads->second);
+
+        if (revalidate)
+        {
+            m_config = std::make_unique<ScopedConfig>("local_repodata_ttl", "0");
+            return;
+        }
+
+        auto channel_ttls = read_channel_ttls();
+        if (channel_ttls.empty())
+            return;
+
+        double expired = HUGE_VAL, fresh = 0;
+        for (auto& entry : cache_entries())
+        {
+            double age = seconds_since(fs::last_write_time(entry.json_file));
+            if (age > repodata_ttl(entry, channel_ttls))
+                expired = std::min(expired, age);
+            else
+                fresh = std::max(fresh, age);
+        }
+
+        double ttl = std::isinf(expired) ? fresh + 60 : std::floor(std::min((fresh + expired) / 2, expired - 1));
+        // 1 would mean the server's max-age.
+        ttl = ttl <= 1 ? 0 : ttl;
+        m_config = std::make_unique<ScopedConfig>("local_repodata_ttl", std::to_string(static_cast<long long>(ttl)));
+    }
+
+private:
+    std::unique_ptr<ScopedConfig> m_downloads;
+    std::unique_ptr<ScopedConfig> m_config;
+};
+
+// Name of the package a match spec or a dependency refers to, e.g. r-base
+// for "conda-forge::r-base >=4.0,<4.1".
+std::string spec_name(const std::string& spec)
+{
+    std::string name = spec;
+    std::size_t channel = name.find("::");
+    if (channel != std::string::npos)
+        name = name.substr(channel + 2);
+    name.erase(0, name.find_first_not_of(" \t"));
+    return name.substr(0, name.find_first_of(" =<>!~[,"));
+}
+
+// Version constraint of a dependency, e.g. ">=4.0,<4.1" for
+// "r-base >=4.0,<4.1"; empty when it has none.
+std::string spec_version(const std::string& spec)
+{
+    std::string rest = spec;
+    std::size_t channel = rest.find("::");
+    if (channel != std::string::npos)
+        rest = rest.substr(channel + 2);
+    rest.erase(0, rest.find_first_not_of(" \t"));
+    rest.erase(0, spec_name(rest).size());
+    rest.erase(0, rest.find_first_not_of(" \t"));
+    return rest.substr(0, rest.find_first_of(" \t["));
+}
+
+// Ordering of conda versions, as conda's VersionOrder: an optional epoch,
+// components split on "." "-" "_", each a run of numbers and words where
+// "dev" sorts before any other word, words before numbers and "post" after
+// everything. A local version after "+" only breaks ties.
+struct VersionPart
+{
+    int rank;
+    long long number;
+    std::string word;
+};
+
+using VersionComponents = std::vector<std::vector<VersionPart>>;
+
+struct CondaVersion
+{
+    VersionComponents version;
+    VersionComponents local;
+};
+
+VersionComponents version_components(const std::string& text)
+{
+    VersionComponents components;
+    std::size_t start = 0;
+    while (start <= text.size())
+    {
+        std::size_t end = std::min(text.find_first_of(".-_", start), text.size());
+        std::vector<VersionPart> parts;
+        std::size_t i = start;
+        while (i < end)
+        {
+            std::size_t j = i;
+            bool digits = std::isdigit(static_cast<unsigned char>(text[i]));
+            while (j < end && static_cast<bool>(std::isdigit(static_cast<unsigned char>(text[j]))) == digits)
+                ++j;
+            std::string run = text.substr(i, j - i);
+            if (digits)
+                parts.push_back({ 2, std::stoll(run.substr(0, 18)), "" });
+            else if (run == "post")
+                parts.push_back({ 3, 0, "" });
+            else
+                parts.push_back({ run == "dev" ? 0 : 1, 0, run });
+            i = j;
+        }
+        if (parts.empty() || parts[0].rank != 2)
+            parts.insert(parts.begin(), { 2, 0, "" });
+        components.push_back(parts);
+        start = end + 1;
+    }
+    return components;
+}
+
+CondaVersion parse_version(std::string text)
+{
+    std::transform(text.begin(), text.end(), text.begin(), [](unsigned char c) { return std::tolower(c); });
+    CondaVersion version;
+    std::size_t plus = text.find('+');
+    if (plus != std::string::npos)
+    {
+        version.local = version_components(text.substr(plus + 1));
+        text.erase(plus);
+    }
+    std::size_t bang = text.find('!');
+    std::string epoch = bang == std::string::npos ? "0" : text.substr(0, bang);
+    version.version = version_components(epoch);
+    for (auto& component : version_components(bang == std::string::npos ? text : text.substr(bang + 1)))
+        version.version.push_back(component);
+    return version;
+}
+
+int compare_parts(const VersionPart& a, const VersionPart& b)
+{
+    if (a.rank != b.rank)
+        return a.rank < b.rank ? -1 : 1;
+    if (a.rank == 2 && a.number != b.number)
+        return a.number < b.number ? -1 : 1;
+    if (a.rank == 1 && a.word != b.word)
+        return a.word < b.word ? -1 : 1;
+    return 0;
+}
+
+int compare_component(const std::vector<VersionPart>& a, const std::vector<VersionPart>& b)
+{
+    const VersionPart zero = { 2, 0, "" };
+    for (std::size_t i = 0; i < std::max(a.size(), b.size()); ++i)
+    {
+        int c = compare_parts(i < a.size() ? a[i] : zero, i < b.size() ? b[i] : zero);
+        if (c != 0)
+            return c;
+    }
+    return 0;
+}
+
+int compare_components(const VersionComponents& a, const VersionComponents& b)
+{
+    const std::vector<VersionPart> zero = { { 2, 0, "" } };
+    for (std::size_t i = 0; i < std::max(a.size(), b.size()); ++i)
+    {
+        int c = compare_component(i < a.size() ? a[i] : zero, i < b.size() ? b[i] : zero);
+        if (c != 0)
+            return c;
+    }
+    return 0;
+}
+
+int compare_versions(const CondaVersion& a, const CondaVersion& b)
+{
+    int c = compare_components(a.version, b.version);
+    return c != 0 ? c : compare_components(a.local, b.local);
+}
+
+// Whether `version` is `prefix` or one of its sub-versions, as for "1.2.*".
+bool version_starts_with(const CondaVersion& version, const CondaVersion& prefix)
+{
+    const std::vector<VersionPart> zero = { { 2, 0, "" } };
+    for (std::size_t i = 0; i < prefix.version.size(); ++i)
+    {
+        if (compare_component(i < version.version.size() ? version.version[i] : zero, prefix.version[i]) != 0)
+            return false;
+    }
+    return true;
+}
+
+bool version_term_matches(const CondaVersion& version, std::string term)
+{
+    term.erase(0, term.find_first_not_of(" \t"));
+    term.erase(term.find_last_not_of(" \t") + 1);
+    if (term.empty() || term == "*")
+        return true;
+
+    std::string op;
+    for (const char* candidate : { ">=", "<=", "==", "!=", "~=", ">", "<", "=" })
+    {
+        if (term.compare(0, std::strlen(candidate), candidate) == 0)
+        {
+            op = candidate;
+            term.erase(0, op.size());
+            break;
+        }
+    }
+    bool prefix = op == "=";
+    if (term.size() >= 2 && term.compare(term.size() - 2, 2, ".*") == 0)
+    {
+        prefix = true;
+        term.erase(term.size() - 2);
+    }
+    else if (!term.empty() && term.back() == '*')
+    {
+        prefix = true;
+        term.pop_back();
+    }
+
+    CondaVersion target = parse_version(term);
+    if (op == "~=")
+    {
+        std::size_t dot = term.find_last_of('.');
+        return compare_versions(version, target) >= 0
+               && (dot == std::string::npos || version_starts_with(version, parse_version(term.substr(0, dot))));
+    }
+    if (prefix && (op.empty() || op == "=" || op == "==" || op == "!="))
+        return version_starts_with(version, target) != (op == "!=");
+
+    int c = compare_versions(version, target);
+    if (op == ">=")
+        return c >= 0;
+    if (op == "<=")
+        return c <= 0;
+    if (op == ">")
+        return c > 0;
+    if (op == "<")
+        return c < 0;
+    if (op == "!=")
+        return c != 0;
+    return c == 0;
+}
+
+// Whether a version satisfies a conda version constraint such as
+// ">=1.2,<2|3.0.*", where "," binds tighter than "|".
+bool version_matches(const std::string& version, const std::string& constraint)
+{
+    CondaVersion parsed = parse_version(version);
+    std::size_t start = 0;
+    while (start <= constraint.size())
+    {
+        std::size_t end = std::min(constraint.find('|', start), constraint.size());
+        std::string alternative = constraint.substr(start, end - start);
+        bool all = true;
+        std::size_t term_start = 0;
+        while (all && term_start <= alternative.size())
+        {
+            std::size_t term_end = std::min(alternative.find(',', term_start), alternative.size());
+            all = version_term_matches(parsed, alternative.substr(term_start, term_end - term_start));
+            term_start = term_end + 1;
+        }
+        if (all)
+            return true;
+        start = end + 1;
+    }
+    return false;
+}
+
+fs::path shards_dir(const CacheEntry& entry)
+{
+    return fs::path(entry.source_file).replace_extension(".shards");
+}
+
+// sha256 of a file, remembered for as long as its size and modification time
+// stay the same. Called from parallel_for() workers: the memo is locked, the
+// hashing is not.
+std::string content_hash(const fs::path& path)
+{
+    static std::map<std::string, std::pair<std::string, std::string>> hashes;
+    static std::mutex hashes_mutex;
+    std::string stamp = std::to_string(fs::file_size(path)) + ":"
+                        + std::to_string(fs::last_write_time(path).time_since_epoch().count());
+    {
+        std::lock_guard<std::mutex> guard(hashes_mutex);
+        auto it = hashes.find(path.string());
+        if (it != hashes.end() && it->second.first == stamp)
+            return it->second.second;
+    }
+    std::string hash = sha256_file(path);
+    std::lock_guard<std::mutex> guard(hashes_mutex);
+    hashes[path.string()] = { stamp, hash };
+    return hash;
+}
+
+// Identifies the content of a cached repodata file. Not its modification
+// time: libmamba touches the file on every 304, when nothing changed. A
+// server that sends neither an etag nor a date leaves the content itself.
+std::string cache_fingerprint(const CacheEntry& entry)
+{
+    auto header = cache_header(entry.source_file);
+    std::string fingerprint = header["_url"] + "\n" + header["_etag"] + "\n" + header["_mod"] + "\n"
+                              + std::to_string(fs::file_size(entry.source_file)) + "\n";
+    if (header["_etag"].empty() && header["_mod"].empty())
+        fingerprint += content_hash(entry.source_file) + "\n";
+    return fingerprint;
+}
+
+// On-demand reading of a repodata file: the packages / packages.conda maps
+// are walked structurally over the mapped file, each record is skipped as a
+// whole and only parsed by the callers that need it. Strings are skipped with
+// memchr, which the C library vectorizes, so most of the file is never looked
+// at byte by byte.
+class RepodataScanner
+{
+public:
+    explicit RepodataScanner(const fs::path& path)
+        : m_path(path)
+        , m_file(path)
+    {
+    }
+
+    // Calls `on_header(key, begin, end)` with the raw text of every member of
+    // the document but the package maps, and `on_record(key, fn, begin,
+    // end)` with the raw text of every record.
+    template <class OnHeader, class OnRecord>
+    void scan(OnHeader on_header, OnRecord on_record) const
+    {
+        const char* end = m_file.data() + m_file.size();
+        for_each_member(m_file.data(), end, [&](const std::string& key, const char* begin, const char* value_end) {
+            if (key == "packages" || key == "packages.conda")
+            {
+                for_each_member(begin, value_end, [&](const std::string& fn, const char* record, const char* record_end) {
+                    on_record(key, fn, record, record_end);
+                });
+            }
+            else
+            {
+                on_header(key, begin, value_end);
+            }
+        });
+    }
+
+    // Calls `on_member(key, begin, end)` with the raw text of every member of
+    // the object in [p, end).
+    template <class OnMember>
+    void for_each_member(const char* p, const char* end, OnMember on_member) const
+    {
+        p = expect(space(p, end), end, '{');
+        p = space(p, end);
+        if (p < end && *p == '}')
+            return;
+        while (true)
+        {
+            const char* key = p;
+            p = skip_string(p, end);
+            std::string name = string(key, p);
+            p = space(expect(space(p, end), end, ':'), end);
+            const char* value = p;
+            p = skip_value(p, end);
+            on_member(name, value, p);
+            p = space(p, end);
+            if (p < end && *p == ',')
+            {
+                p = space(p + 1, end);
+                continue;
+            }
+            expect(p, end, '}');
+            return;
+        }
+    }
+
+    // Calls `on_element(begin, end)` with the raw text of every element of
+    // the array in [p, end).
+    template <class OnElement>
+    void for_each_element(const char* p, const char* end, OnElement on_element) const
+    {
+        p = space(expect(space(p, end), end, '['), end);
+        if (p < end && *p == ']')
+            return;
+        while (true)
+        {
+            const char* value = p;
+            p = skip_value(p, end);
+            on_element(value, p);
+            p = space(p, end);
+            if (p < end && *p == ',')
+            {
+                p = space(p + 1, end);
+                continue;
+            }
+            expect(p, end, ']');
+            return;
+        }
+    }
+
+    // Raw text of the member `name` of an object, empty if it has none.
+    std::pair<const char*, const char*> member(const char* begin, const char* end, const std::string& name) const
+    {
+        std::pair<const char*, const char*> found;
+        for_each_member(begin, end, [&](const std::string& key, const char* value, const char* value_end) {
+            if (key == name && !found.first)
+                found = { value, value_end };
+        });
+        return found;
+    }
+
+    // The value of a JSON string.
+    std::string string(const char* begin, const char* end) const
+    {
+        if (end - begin < 2 || *begin != '"')
+            malformed();
+        if (std::memchr(begin, '\\', end - begin) == nullptr)
+            return std::string(begin + 1, end - 1);
+        return json::parse(begin, end).get<std::string>();
+    }
+
+    // The integer part of a JSON number, 0 for anything else.
+    uint64_t number(const char* begin, const char* end) const
+    {
+        return std::strtoull(std::string(begin, end).c_str(), nullptr, 10);
+    }
+
+private:
+    static const char* space(const char* p, const char* end)
+    {
+        while (p < end && (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t'))
+            ++p;
+        return p;
+    }
+
+    const char* expect(const char* p, const char* end, char c) const
+    {
+        if (p >= end || *p != c)
+            malformed();
+        return p + 1;
+    }
+
+    const char* skip_string(const char* p, const char* end) const
+    {
+        p = expect(p, end, '"');
+        while (true)
+        {
+            auto quote = static_cast<const char*>(std::memchr(p, '"', end - p));
+            if (!quote)
+                malformed();
+            const char* escape = quote;
+            while (escape > p && escape[-1] == '\\')
+                --escape;
+            if ((quote - escape) % 2 == 0)
+                return quote + 1;
+            p = quote + 1;
+        }
+    }
+
+    const char* skip_value(const char* p, const char* end) const
+    {
+        if (p >= end)
+            malformed();
+        if (*p == '"')
+            return skip_string(p, end);
+        if (*p != '{' && *p != '[')
+        {
+            while (p < end && *p != ',' && *p != '}' && *p != ']' && *p != ' ' && *p != '\n' && *p != '\r' && *p != '\t')
+                ++p;
+            return p;
+        }
+        std::size_t depth = 0;
+        while (p < end)
+        {
+            switch (*p)
+            {
+                case '"':
+                    p = skip_string(p, end);
+                    continue;
+                case '{':
+                case '[':
+                    ++depth;
+                    break;
+                case '}':
+                case ']':
+                    if (--depth == 0)
+                        return p + 1;
+                    break;
+            }
+            ++p;
+        }
+        malformed();
+    }
+
+    [[noreturn]] void malformed() const
+    {
+        throw std::runtime_error("Malformed repodata " + m_path.string());
+    }
+
+    fs::path m_path;
+    MappedFile m_file;
+};
+
+// A record of a repodata file, left unparsed in the mapped file.
+struct RawRecord
+{
+    bool conda;
+    std::string fn;
+    const char* begin;
+    const char* end;
+};
+
+// The records of a repodata file grouped by package name, only parsed when
+// asked for; `header` gets the rest of the document.
+class RawRepodata
+{
+public:
+    explicit RawRepodata(const fs::path& path)
+        : m_scanner(path)
+    {
+        m_scanner.scan(
+            [this](const std::string& key, const char* begin, const char* end) {
+                if (key != "removed")
+                    header[key] = json::parse(begin, end);
+            },
+            [this](const std::string& key, const std::string& fn, const char* begin, const char* end) {
+                auto member = m_scanner.member(begin, end, "name");
+                std::string name = member.first ? m_scanner.string(member.first, member.second) : "";
+                if (name.empty())
+                    return;
+                by_name[name].push_back({ key != "packages", fn, begin, end });
+                ++records;
+            });
+    }
+
+    // {"packages": ..., "packages.conda": ...} of one name.
+    json parse(const std::vector<RawRecord>& raw) const
+    {
+        json parsed = json::object();
+        for (auto& record : raw)
+            parsed[record.conda ? "packages.conda" : "packages"][record.fn] = json::parse(record.begin, record.end);
+        return parsed;
+    }
+
+    // The same as text, without parsing the records.
+    std::string text(const std::vector<RawRecord>& raw) const
+    {
+        std::string packages, conda;
+        for (auto& record : raw)
+        {
+            std::string& out = record.conda ? conda : packages;
+            out += (out.empty() ? "" : ",") + json(record.fn).dump() + ":";
+            out.append(record.begin, record.end);
+        }
+        std::string text = packages.empty() ? "" : "\"packages\":{" + packages + "}";
+        if (!conda.empty())
+            text += (text.empty() ? "" : ",") + std::string("\"packages.conda\":{") + conda + "}";
+        return "{" + text + "}";
+    }
+
+    json header = json::object();
+    std::map<std::string, std::vector<RawRecord>> by_name;
+    std::size_t records = 0;
+
+private:
+    RepodataScanner m_scanner;
+};
+
+// What a solve needs of a record. Both methods extract it from every record,
+// so that benchmark_repodata_parse() compares the same work.
+struct RecordFields
+{
+    std::string fn;
+    std::string name;
+    std::string version;
+    std::vector<std::string> depends;
+};
+
+std::vector<RecordFields> repodata_fields(const fs::path& path, const std::string& method)
+{
+    std::vector<RecordFields> records;
+    if (method == "dom")
+    {
+        json repodata = parse_json_file(path);
+        for (const char* key : { "packages", "packages.conda" })
+        {
+            if (!repodata.contains(key))
+                continue;
+            for (auto& [fn, record] : repodata[key].items())
+                records.push_back({ fn, record.value("name", ""), record.value("version", ""),
+                                    record.value("depends", std::vector<std::string>{}) });
+        }
+    }
+    else if (method == "ondemand")
+    {
+        RepodataScanner scanner(path);
+        scanner.scan([](const std::string&, const char*, const char*) {},
+                     [&](const std::string&, const std::string& fn, const char* begin, const char* end) {
+                         RecordFields fields;
+                         fields.fn = fn;
+                         scanner.for_each_member(begin, end, [&](const std::string& key, const char* value, const char* value_end) {
+                             if (key == "name")
+                                 fields.name = scanner.string(value, value_end);
+                             else if (key == "version")
+                                 fields.version = scanner.string(value, value_end);
+                             else if (key == "depends")
+                                 scanner.for_each_element(value, value_end, [&](const char* dep, const char* dep_end) {
+                                     fields.depends.push_back(scanner.string(dep, dep_end));
+                                 });
+                         });
+                         records.push_back(std::move(fields));
+                     });
+    }
+    return records;
+}
+
+// Parses a repodata file once, either into a full document ("dom") or with
+// the on-demand scanner ("ondemand"), extracting the fields of every record,
+// and returns the number of records.
+std::size_t parse_repodata(const fs::path& path, const std::string& method)
+{
+    return repodata_fields(path, method).size();
+}
+
+// The records as each method sees them; the two must agree.
+// [[Rcpp::export(.repodata_fields)]]
+r::DataFrame repodata_fields_frame(const char* path, const char* method)
+{
+    std::vector<std::string> fns, names, versions, depends;
+    for (auto& record : repodata_fields(path, method))
+    {
+        fns.push_back(record.fn);
+        names.push_back(record.name);
+        versions.push_back(record.version);
+        std::string joined;
+        for (auto& dep : record.depends)
+            joined += (joined.empty() ? "" : ", ") + dep;
+        depends.push_back(joined);
+    }
+    return r::DataFrame::create(r::Named("fn") = fns,
+                                r::Named("name") = names,
+                                r::Named("version") = versions,
+                                r::Named("depends") = depends,
+                                r::Named("stringsAsFactors") = false);
+}
+
+// Parses a repodata file in this process and prints the number of records
+// and the seconds it took, for measure_parse.
+// [[Rcpp::export(.parse_repodata_run)]]
+void parse_repodata_run(const char* path, const char* method)
+{
+    auto start = std::chrono::steady_clock::now();
+    std::size_t records = parse_repodata(path, method);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    r::Rcout << "parsed: " << records << " " << seconds << std::endl;
+}
+
+struct ParseRun
+{
+    double seconds = 0;
+    double records = 0;
+    double peak_mb = NA_REAL;
+};
+
+// Runs one parse in a separate Rscript process, so that its peak resident
+// size is measured on its own rather than on top of whatever this session
+// already touched, without forking a session that may run threads.
+ParseRun measure_parse(const fs::path& path, const std::string& method)
+{
+    ParseRun run;
+#ifdef _WIN32
+    auto start = std::chrono::steady_clock::now();
+    run.records = static_cast<double>(parse_repodata(path, method));
+    run.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+#else
+    fs::path output = rhumba_dir() / ("parse-" + std::to_string(getpid()) + ".out");
+    fs::create_directories(output.parent_path());
+    fs::remove(output);
+    pid_t pid = spawn_rscript("rhumba:::.parse_repodata_run(" + r_string(path.string()) + ", " + r_string(method) + ")",
+                              output);
+    int status = 0;
+    struct rusage usage = {};
+    while (wait4(pid, &status, 0, &usage) < 0 && errno == EINTR)
+        ;
+    // R may print warnings around the result.
+    std::string text = fs::exists(output) ? read_file(output) : "";
+    fs::remove(output);
+    std::size_t result = text.rfind("parsed: ");
+    std::istringstream in(result == std::string::npos ? "" : text.substr(result + 8));
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0 || !(in >> run.records >> run.seconds))
+        r::stop("Could not parse " + path.string() + " (" + method + ")");
+#ifdef __APPLE__
+    run.peak_mb = usage.ru_maxrss / (1024.0 * 1024.0);
+#else
+    run.peak_mb = usage.ru_maxrss / 1024.0;
+#endif
+#endif
+    return run;
+}
+
+std::size_t record_count(const json& records)
+{
+    std::size_t count = 0;
+    for (auto& [key, value] : records.items())
+    {
+        if (key == "packages" || key == "packages.conda")
+            count += value.size();
+    }
+    return count;
+}
+
+// Threads used for the per-repodata work done on this side (parsing,
+// shards, indexes); set_config("repodata_threads", n) caps it.
+std::size_t repodata_threads()
+{
+    auto it = config_values.find("repodata_threads");
+    if (it != config_values.end() && !it->second.empty())
+    {
+        int threads = std::atoi(it->second.c_str());
+        if (threads > 0)
+            return static_cast<std::size_t>(threads);
+    }
+    return std::max(std::thread::hardware_concurrency(), 1u);
+}
+
+void rethrow_in_r(std::exception_ptr error)
+{
+    if (!error)
+        return;
+    try
+    {
+        std::rethrow_exception(error);
+    }
+    catch (const std::exception& e)
+    {
+        r::stop(e.what());
+    }
+}
+
+// Runs task(i) for every i < n on up to repodata_threads() threads. Tasks
+// must not call into R and report errors by throwing standard exceptions;
+// the first one becomes an R error on this thread once all are done.
+template <class Task>
+void parallel_for(std::size_t n, Task task)
+{
+    std::exception_ptr error;
+    std::size_t threads = std::min(n, repodata_threads());
+    if (threads <= 1)
+    {
+        try
+        {
+            for (std::size_t i = 0; i < n; ++i)
+                task(i);
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+        }
+        rethrow_in_r(error);
+        return;
+    }
+
+    std::atomic<std::size_t> next(0);
+    std::mutex error_mutex;
+    std::vector<std::thread> workers;
+    for (std::size_t t = 0; t < threads; ++t)
+    {
+        workers.emplace_back([&]() {
+            for (std::size_t i = next++; i < n; i = next++)
+            {
+                try
+                {
+                    task(i);
+                }
+                catch (...)
+                {
+                    std::lock_guard<std::mutex> guard(error_mutex);
+                    if (!error)
+                        error = std::current_exception();
+                    next = n;
+                }
+            }
+        });
+    }
+    for (auto& worker : workers)
+        worker.join();
+    rethrow_in_r(error);
+}
+
+// Splits a repodata file into one <name>.json per package name under `dir`,
+// plus .header.json (everything else), .names, .records and .fingerprint,
+// written last. Returns the number of package names.
+std::size_t write_shards(const fs::path& source, const fs::path& dir, const std::string& fingerprint)
+{
+    RawRepodata repodata(source);
+
+    fs::path tmp = dir;
+    tmp += ".tmp";
+    fs::remove_all(tmp);
+    fs::create_directories(tmp);
+    json names = json::array();
+    for (auto& [name, records] : repodata.by_name)
+    {
+        names.push_back(name);
+        write_file(tmp / (name + ".json"), repodata.text(records));
+    }
+    write_file(tmp / ".header.json", repodata.header.dump());
+    write_file(tmp / ".names", names.dump());
+    write_file(tmp / ".records", std::to_string(repodata.records));
+    write_file(tmp / ".fingerprint", fingerprint);
+
+    fs::remove_all(dir);
+    fs::rename(tmp, dir);
+    return repodata.by_name.size();
+}
+
+// Splits a cached repodata file into one file per package name, next to it,
+// rebuilt whenever the repodata it comes from changes.
+bool build_shards(const CacheEntry& entry)
+{
+    fs::path dir = shards_dir(entry);
+    std::string fingerprint = cache_fingerprint(entry);
+    if (fs::exists(dir / ".fingerprint") && read_file(dir / ".fingerprint") == fingerprint)
+        return false;
+    write_shards(entry.source_file, dir, fingerprint);
+    return true;
+}
+
+bool glob_match(const char* pattern, const char* name)
+{
+    if (*pattern == '\0')
+        return *name == '\0';
+    if (*pattern == '*')
+        return glob_match(pattern + 1, name) || (*name && glob_match(pattern, name + 1));
+    return *name && (*pattern == '?' || *pattern == *name) && glob_match(pattern + 1, name + 1);
+}
+
+std::vector<std::string> setting_list(const std::string& name)
+{
+    std::vector<std::string> values;
+    auto it = config_values.find(name);
+    if (it == config_values.end())
+        return values;
+
+    std::string value = it->second;
+    std::size_t start = 0;
+    while (start <= value.size())
+    {
+        std::size_t end = std::min(value.find(',', start), value.size());
+        std::string item = value.substr(start, end - start);
+        item.erase(0, item.find_first_not_of(" \t"));
+        item.erase(item.find_last_not_of(" \t") + 1);
+        if (!item.empty())
+            values.push_back(item);
+        start = end + 1;
+    }
+    return values;
+}
+
+// Package names allowed into the solver pool by repodata_allow and
+// repodata_deny, lists of glob patterns such as "r-*".
+struct RepodataFilter
+{
+    RepodataFilter()
+        : allow(setting_list("repodata_allow"))
+        , deny(setting_list("repodata_deny"))
+        , seeds(setting_list("repodata_seeds"))
+    {
+    }
+
+    bool active() const
+    {
+        return !allow.empty() || !deny.empty() || !seeds.empty();
+    }
+
+    bool accepts(const std::string& name) const
+    {
+        auto matches = [&name](const std::string& pattern) { return glob_match(pattern.c_str(), name.c_str()); };
+        if (!allow.empty() && std::none_of(allow.begin(), allow.end(), matches))
+            return false;
+        return std::none_of(deny.begin(), deny.end(), matches);
+    }
+
+    std::vector<std::string> allow;
+    std::vector<std::string> deny;
+    std::vector<std::string> seeds;
+};
+
+// Records of the packages reachable from `seeds` through their dependencies,
+// one object per cache entry. `lookup(i, name)` returns the records of a name
+// in entry i, or null. The names are visited one dependency level at a time,
+// each level announced to `prefetch(names)` first.
+template <class Lookup, class Prefetch>
+std::vector<json> dependency_closure(std::vector<json> headers, const std::vector<std::string>& seeds,
+                                     const RepodataFilter& filter, Lookup lookup, Prefetch prefetch)
+{
+    for (auto& header : headers)
+    {
+        header["packages"] = json::object();
+        header["packages.conda"] = json::object();
+    }
+
+    std::unordered_set<std::string> seen;
+    std::vector<std::string> level = seeds;
+    while (!level.empty())
+    {
+        std::vector<std::string> names;
+        for (auto& name : level)
+        {
+            if (!name.empty() && name.compare(0, 2, "__") != 0 && seen.insert(name).second && filter.accepts(name))
+                names.push_back(name);
+        }
+        prefetch(names);
+
+        std::vector<std::string> next;
+        for (auto& name : names)
+        {
+            for (std::size_t i = 0; i < headers.size(); ++i)
+            {
+                json records = lookup(i, name);
+                if (records.is_null())
+                    continue;
+                for (auto& [key, by_fn] : records.items())
+                {
+                    for (auto& [fn, record] : by_fn.items())
+                    {
+                        for (auto& dep : record.value("depends", std::vector<std::string>{}))
+                            next.push_back(spec_name(dep));
+                        headers[i][key][fn] = std::move(record);
+                    }
+                }
+            }
+        }
+        level = std::move(next);
+    }
+    return headers;
+}
+
+// Downloads every url to the file next to it, at once through R's libcurl
+// support. Files that could not be downloaded are left out. Calls into R, so
+// only on the main thread.
+void download_files(const std::vector<std::string>& urls, const std::vector<fs::path>& files)
+{
+    std::vector<std::string> remote_urls, remote_files;
+    for (std::size_t i = 0; i < urls.size(); ++i)
+    {
+        std::error_code ec;
+        fs::remove(files[i], ec);
+        if (urls[i].compare(0, 7, "file://") == 0)
+        {
+            if (fs::exists(urls[i].substr(7)))
+                fs::copy_file(urls[i].substr(7), files[i], ec);
+            continue;
+        }
+        remote_urls.push_back(urls[i]);
+        remote_files.push_back(files[i].string());
+    }
+    if (remote_urls.empty())
+        return;
+
+    // Missing files are expected, e.g. channels that publish no shards, and
+    // must not surface as R warnings.
+    static const char* code = "function(urls, files) tryCatch(suppressWarnings(utils::download.file("
+                              "urls, files, method = 'libcurl', quiet = TRUE, mode = 'wb')), error = function(e) 1L)";
+    r::Function download(r::Function("eval")(r::Function("parse")(r::Named("text") = code)));
+    download(remote_urls, remote_files);
+}
+
+// Shards a channel publishes with publish_index_shards(), served under
+// <channel>/<subdir>/repodata_shards/, so that solves only download the
+// packages they can reach instead of the whole repodata. Fetched files are
+// cached in the rhumba directory until the published .fingerprint changes,
+// which is checked once the channel's TTL has passed.
+class RemoteShards
+{
+public:
+    RemoteShards(const std::string& url, double ttl)
+        : m_base(url + "/repodata_shards/")
+        , m_dir(rhumba_dir() / "shards" / md5_hex(url + "/").substr(0, 8))
+    {
+        fs::path unpublished = m_dir;
+        unpublished += ".none";
+        if (fs::exists(unpublished) && seconds_since(fs::last_write_time(unpublished)) < 24 * 3600)
+            return;
+
+        fs::path fingerprint = m_dir / ".fingerprint";
+        if (!fs::exists(fingerprint) || seconds_since(fs::last_write_time(fingerprint)) > ttl)
+        {
+            fs::create_directories(m_dir.parent_path());
+            fs::path published = m_dir;
+            published += ".fingerprint";
+            download_files({ m_base + ".fingerprint" }, { published });
+            std::string value = fs::exists(published) ? read_file(published) : "";
+            fs::remove(published);
+            if (value.size() != 64 || value.find_first_not_of("0123456789abcdef") != std::string::npos)
+            {
+                fs::remove_all(m_dir);
+                write_file(unpublished, "");
+                return;
+            }
+            fs::remove(unpublished);
+
+            if (fs::exists(fingerprint) && read_file(fingerprint) == value)
+            {
+                fs::last_write_time(fingerprint, fs::file_time_type::clock::now());
+            }
+            else
+            {
+                fs::remove_all(m_dir);
+                fs::create_directories(m_dir);
+                std::vector<std::string> names = { ".header.json", ".names", ".records" };
+                std::vector<std::string> urls;
+                std::vector<fs::path> files;
+                for (auto& name : names)
+                {
+                    urls.push_back(m_base + name);
+                    files.push_back(m_dir / name);
+                }
+                download_files(urls, files);
+                if (!valid_json(m_dir / ".header.json") || !valid_json(m_dir / ".names") || !fs::exists(m_dir / ".records"))
+                    return;
+                write_file(fingerprint, value);
+            }
+        }
+        if (!fs::exists(fingerprint))
+            return;
+
+        for (auto& name : parse_json_file(m_dir / ".names"))
+            m_names.insert(name.get<std::string>());
+        m_available = true;
+    }
+
+    bool available() const
+    {
+        return m_available;
+    }
+
+    json header() const
+    {
+        return parse_json_file(m_dir / ".header.json");
+    }
+
+    double records() const
+    {
+        return std::atof(read_file(m_dir / ".records").c_str());
+    }
+
+    void prefetch(const std::vector<std::string>& names)
+    {
+        std::vector<std::string> urls;
+        std::vector<fs::path> files;
+        for (auto& name : names)
+        {
+            if (m_names.count(name) && !fs::exists(m_dir / (name + ".json")))
+            {
+                urls.push_back(m_base + name + ".json");
+                files.push_back(m_dir / (name + ".json"));
+            }
+        }
+        if (!urls.empty())
+            download_files(urls, files);
+    }
+
+    json lookup(const std::string& name)
+    {
+        if (!m_names.count(name))
+            return json();
+        prefetch({ name });
+        fs::path shard = m_dir / (name + ".json");
+        if (!valid_json(shard))
+            r::stop("Could not download " + m_base + name + ".json");
+        return parse_json_file(shard);
+    }
+
+private:
+    static bool valid_json(const fs::path& path)
+    {
+        if (!fs::exists(path))
+            return false;
+        std::string data = read_file(path);
+        if (json::accept(data))
+            return true;
+        fs::remove(path);
+        return false;
+    }
+
+    std::string m_base;
+    fs::path m_dir;
+    std::unordered_set<std::string> m_names;
+    bool m_available = false;
+};
+
+struct FilterStats
+{
+    std::string channel;
+    std::string subdir;
+    double records = 0;
+    double kept = 0;
+};
+
+std::vector<FilterStats> last_filter_stats;
+
+std::vector<std::string> json_pointer_tokens(const std::string& pointer)
+{
+    std::vector<std::string> tokens;
+    std::size_t start = 1;
+    while (start <= pointer.size() && pointer.size() > 1)
+    {
+        std::size_t end = std::min(pointer.find('/', start), pointer.size());
+        std::string token = pointer.substr(start, end - start);
+        for (std::size_t pos = 0; (pos = token.find('~', pos)) != std::string::npos; ++pos)
+            token.replace(pos, 2, token.compare(pos, 2, "~1") == 0 ? "/" : "~");
+        tokens.push_back(token);
+        start = end + 1;
+    }
+    return tokens;
+}
+
+// Local path of a patch, downloading it first when it is a URL.
+fs::path fetch_patch(const std::string& location, fs::path& downloaded)
+{
+    if (location.compare(0, 7, "file://") == 0)
+        return location.substr(7);
+    if (location.find("://") == std::string::npos)
+        return location;
+
+    downloaded = rhumba_dir() / "repodata-patch.json";
+    r::Function download_file("download.file");
+    download_file(location, downloaded.string(), r::Named("quiet") = true, r::Named("mode") = "wb");
+    return downloaded;
+}
+
+// Rewrites the shards of the given package names after a patch, leaving the
+// others untouched.
+void update_shards(const CacheEntry& entry, const json& repodata, const std::unordered_set<std::string>& names,
+                   bool header_changed)
+{
+    fs::path dir = shards_dir(entry);
+    if (!fs::exists(dir / ".fingerprint"))
+        return;
+
+    std::map<std::string, json> shards;
+    std::size_t records = 0;
+    for (const char* key : { "packages", "packages.conda" })
+    {
+        if (!repodata.contains(key))
+            continue;
+        records += repodata[key].size();
+        for (auto& [fn, record] : repodata[key].items())
+        {
+            std::string name = record.value("name", "");
+            if (names.count(name))
+                shards[name][key][fn] = record;
+        }
+    }
+
+    std::set<std::string> all_names;
+    if (fs::exists(dir / ".names"))
+        all_names = parse_json_file(dir / ".names").get<std::set<std::string>>();
+    for (auto& name : names)
+    {
+        if (shards.count(name))
+        {
+            write_file(dir / (name + ".json"), shards[name].dump());
+            all_names.insert(name);
+        }
+        else
+        {
+            fs::remove(dir / (name + ".json"));
+            all_names.erase(name);
+        }
+    }
+    write_file(dir / ".names", json(all_names).dump());
+    if (header_changed)
+    {
+        json header = repodata;
+        header.erase("packages");
+        header.erase("packages.conda");
+        header.erase("removed");
+        write_file(dir / ".header.json", header.dump());
+    }
+    write_file(dir / ".records", std::to_string(records));
+    write_file(dir / ".fingerprint", cache_fingerprint(entry));
+}
+
+// A bare name is a snapshot kept in the rhumba directory, like environment
+// names for prefixes.
+fs::path snapshot_path(const std::string& name)
+{
+    if (name.find_first_of("/\\") == std::string::npos)
+        return rhumba_dir() / "snapshots" / name;
+    return fs::absolute(name);
+}
+
+std::vector<CacheEntry> snapshot_entries(const fs::path& dir)
+{
+    if (!fs::exists(dir / "index.json"))
+        r::stop("No repodata snapshot at " + dir.string());
+
+    std::vector<CacheEntry> entries;
+    json index = parse_json_file(dir / "index.json");
+    for (auto& item : index["entries"])
+    {
+        CacheEntry entry;
+        std::string file = item["file"];
+        entry.json_file = pkgs_dir() / "cache" / file;
+        entry.solv_file = fs::path(entry.json_file).replace_extension(".solv");
+        entry.source_file = dir / file;
+        set_entry_url(entry, item["url"]);
+        entries.push_back(entry);
+    }
+    return entries;
+}
+
+std::vector<CacheEntry> active_entries()
+{
+    auto snapshot = config_values.find("snapshot");
+    if (snapshot != config_values.end() && !snapshot->second.empty())
+        return snapshot_entries(snapshot_path(snapshot->second));
+    return cache_entries();
+}
+
+std::string yaml_unquote(std::string value)
+{
+    value.erase(0, value.find_first_not_of(" \t"));
+    value.erase(value.find_last_not_of(" \t\r") + 1);
+    if (value.size() >= 2 && (value[0] == '"' || value[0] == '\'') && value.back() == value[0])
+        return value.substr(1, value.size() - 2);
+    return value;
+}
+
+// The rc files libmamba reads, from the lowest precedence to the highest.
+std::vector<fs::path> rc_files()
+{
+    std::vector<fs::path> candidates = { "/etc/conda/.condarc", "/etc/conda/condarc", "/etc/conda/.mambarc",
+                                         "/var/lib/conda/.condarc", "/var/lib/conda/condarc", "/var/lib/conda/.mambarc" };
+    fs::path root = root_prefix();
+    for (const char* name : { ".condarc", "condarc", ".mambarc" })
+        candidates.push_back(root / name);
+    std::string home = get_env("HOME");
+    if (!home.empty())
+    {
+        for (const char* name : { ".conda/.condarc", ".conda/condarc", ".condarc", ".mambarc" })
+            candidates.push_back(fs::path(home) / name);
+    }
+    for (const char* variable : { "CONDARC", "MAMBARC" })
+    {
+        std::string path = get_env(variable);
+        if (!path.empty())
+            candidates.push_back(path);
+    }
+
+    std::vector<fs::path> files;
+    for (auto& file : candidates)
+    {
+        if (fs::is_regular_file(file))
+            files.push_back(file);
+    }
+    return files;
+}
+
+// The channels: list of an rc file, in block or flow style.
+std::vector<std::string> rc_channels(const fs::path& path)
+{
+    auto strip_comment = [](std::string value) {
+        std::size_t hash = value.find(" #");
+        return yaml_unquote(hash == std::string::npos ? value : value.substr(0, hash));
+    };
+
+    std::vector<std::string> channels;
+    std::ifstream in(path.string());
+    std::string line;
+    bool in_list = false;
+    while (std::getline(in, line))
+    {
+        std::size_t indent = line.find_first_not_of(" \t");
+        if (indent == std::string::npos || line[indent] == '#')
+            continue;
+        if (in_list && line[indent] == '-')
+        {
+            channels.push_back(strip_comment(line.substr(indent + 1)));
+            continue;
+        }
+        in_list = false;
+        if (indent != 0 || line.compare(0, 9, "channels:") != 0)
+            continue;
+
+        std::string rest = strip_comment(line.substr(9));
+        if (rest.empty())
+        {
+            in_list = true;
+        }
+        else if (rest.front() == '[' && rest.back() == ']')
+        {
+            std::size_t start = 1;
+            while (start < rest.size() - 1)
+            {
+                std::size_t end = std::min(rest.find(',', start), rest.size() - 1);
+                std::string channel = yaml_unquote(rest.substr(start, end - start));
+                if (!channel.empty())
+                    channels.push_back(channel);
+                start = end + 1;
+            }
+        }
+    }
+    return channels;
+}
+
+// The channels solves use, in priority order: set_channels() or the
+// channels of the rc files, the ones with the highest precedence first.
+std::vector<std::string> configured_channels()
+{
+    std::vector<std::string> channels;
+    auto add = [&channels](const std::string& channel) {
+        if (!channel.empty() && std::find(channels.begin(), channels.end(), channel) == channels.end())
+            channels.push_back(channel);
+    };
+
+    auto it = config_values.find("channels");
+    if (it != config_values.end() && !it->second.empty())
+    {
+        std::size_t start = 0;
+        while (start <= it->second.size())
+        {
+            std::size_t end = std::min(it->second.find(',', start), it->second.size());
+            add(it->second.substr(start, end - start));
+            start = end + 1;
+        }
+        return channels;
+    }
+
+    auto files = rc_files();
+    for (auto file = files.rbegin(); file != files.rend(); ++file)
+    {
+        for (auto& channel : rc_channels(*file))
+            add(channel);
+    }
+    return channels;
+}
+
+// Url of a channel given by name or url, e.g.
+// https://conda.anaconda.org/conda-forge for conda-forge. Empty for the
+// "defaults" multichannel, which only libmamba resolves.
+std::string channel_url(std::string channel)
+{
+    while (!channel.empty() && channel.back() == '/')
+        channel.pop_back();
+    if (channel.find("://") != std::string::npos)
+        return channel;
+    if (channel.empty() || channel == "defaults")
+        return "";
+
+    std::string alias = "https://conda.anaconda.org";
+    auto it = config_values.find("channel_alias");
+    if (it != config_values.end() && !it->second.empty())
+        alias = it->second;
+    while (!alias.empty() && alias.back() == '/')
+        alias.pop_back();
+    return alias + "/" + channel;
+}
+
+// Cache entries of the configured channels for this platform and noarch,
+// including the ones libmamba has not downloaded yet, whose cache file is
+// named after the md5 of their url like libmamba does. Every cached entry is
+// included when some channel cannot be resolved.
+std::vector<CacheEntry> channel_entries()
+{
+    auto cached = cache_entries();
+    auto channels = configured_channels();
+    bool unresolved = channels.empty();
+    std::vector<CacheEntry> entries;
+    auto add = [&entries](const CacheEntry& entry) {
+        auto same = [&entry](const CacheEntry& e) { return e.json_file == entry.json_file; };
+        if (std::none_of(entries.begin(), entries.end(), same))
+            entries.push_back(entry);
+    };
+
+    for (auto& channel : channels)
+    {
+        std::string base = channel_url(channel);
+        if (base.empty())
+        {
+            unresolved = true;
+            continue;
+        }
+        for (const std::string& subdir : { platform(), std::string("noarch") })
+        {
+            std::string url = base + "/" + subdir;
+            fs::path json_file = pkgs_dir() / "cache" / (md5_hex(url + "/").substr(0, 8) + ".json");
+            auto found = std::find_if(cached.begin(), cached.end(), [&json_file](const CacheEntry& e) {
+                return e.json_file == json_file;
+            });
+            if (found != cached.end())
+            {
+                add(*found);
+                continue;
+            }
+            CacheEntry entry;
+            entry.json_file = json_file;
+            entry.solv_file = fs::path(json_file).replace_extension(".solv");
+            entry.source_file = json_file;
+            set_entry_url(entry, url);
+            add(entry);
+        }
+    }
+    if (unresolved)
+    {
+        for (auto& entry : cached)
+            add(entry);
+    }
+    return entries;
+}
+
+// Fingerprint of the repodata solves load, from the header libmamba writes
+// in front of each cache file (url, etag, last-modified), its size and
+// modification time.
+std::string repodata_fingerprint()
+{
+    auto entries = active_entries();
+    std::sort(entries.begin(), entries.end(), [](const CacheEntry& a, const CacheEntry& b) {
+        return a.json_file < b.json_file;
+    });
+
+    Sha256 hash;
+    for (auto& entry : entries)
+    {
+        hash.update(entry.json_file.filename().string() + "\n");
+        hash.update(cache_fingerprint(entry));
+    }
+    return hash.hexdigest();
+}
+
+std::string solve_cache_key(std::vector<std::string> specs)
+{
+    for (auto& spec : specs)
+    {
+        spec.erase(std::remove_if(spec.begin(), spec.end(), [](unsigned char c) { return std::isspace(c); }),
+                   spec.end());
+    }
+    std::sort(specs.begin(), specs.end());
+    specs.erase(std::unique(specs.begin(), specs.end()), specs.end());
+
+    Sha256 hash;
+    for (auto& spec : specs)
+        hash.update("spec:" + spec + "\n");
+    for (auto& [name, value] : config_values)
+    {
+        if (name != "specs")
+            hash.update("config:" + name + "=" + value + "\n");
+    }
+    for (auto& channel : configured_channels())
+        hash.update("channel:" + channel + "\n");
+    for (auto& file : rc_files())
+        hash.update("rc:" + file.string() + "\n" + read_file(file) + "\n");
+    hash.update("platform:" + platform() + "\n");
+    hash.update("repodata:" + repodata_fingerprint() + "\n");
+    return hash.hexdigest();
+}
+
+// [[Rcpp::export(.solve_cache_key)]]
+std::string solve_key(const std::vector<std::string>& specs)
+{
+    return solve_cache_key(specs);
+}
+
+// Binary index of a repodata file: fixed-width columns of ids into a table of
+// interned strings, which is mapped read-only and queried in place, so every
+// process on the host shares the same pages instead of parsing JSON.
+//
+// Layout: header, timestamps (u64), name, version, build, fn, build_number
+// columns (u32), depends offsets (u32, records + 1), depends ids (u32),
+// string offsets (u32, strings + 1), string bytes.
+struct BinaryIndexHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t records;
+    uint32_t depends;
+    uint32_t strings;
+    uint32_t fingerprint;
+};
+
+const uint32_t binary_index_version = 1;
+
+fs::path binary_index_path(const CacheEntry& entry)
+{
+    return fs::path(entry.source_file).replace_extension(".rbi");
+}
+
+class BinaryIndexWriter
+{
+public:
+    uint32_t intern(const std::string& value)
+    {
+        auto it = m_ids.find(value);
+        if (it != m_ids.end())
+            return it->second;
+        uint32_t id = static_cast<uint32_t>(m_strings.size());
+        m_ids.emplace(value, id);
+        m_strings.push_back(value);
+        return id;
+    }
+
+    // Only the fields the index keeps are read out of the raw record.
+    void add(const RepodataScanner& scanner, const char* begin, const char* end, const std::string& fn)
+    {
+        std::string name, version, build;
+        uint64_t timestamp = 0;
+        uint32_t build_number = 0;
+        m_depends_offsets.push_back(static_cast<uint32_t>(m_depends.size()));
+        scanner.for_each_member(begin, end, [&](const std::string& key, const char* value, const char* value_end) {
+            if (key == "name")
+                name = scanner.string(value, value_end);
+            else if (key == "version")
+                version = scanner.string(value, value_end);
+            else if (key == "build")
+                build = scanner.string(value, value_end);
+            else if (key == "build_number")
+                build_number = static_cast<uint32_t>(scanner.number(value, value_end));
+            else if (key == "timestamp")
+                timestamp = scanner.number(value, value_end);
+            else if (key == "depends")
+                scanner.for_each_element(value, value_end, [&](const char* dep, const char* dep_end) {
+                    m_depends.push_back(intern(scanner.string(dep, dep_end)));
+                });
+        });
+        m_timestamps.push_back(timestamp);
+        m_names.push_back(intern(name));
+        m_versions.push_back(intern(version));
+        m_builds.push_back(intern(build));
+        m_fns.push_back(intern(fn));
+        m_build_numbers.push_back(build_number);
+    }
+
+    void write(const fs::path& path, const std::string& fingerprint)
+    {
+        BinaryIndexHeader header = { { 'R', 'B', 'I', '1' }, binary_index_version, 0, 0, 0, 0 };
+        header.fingerprint = intern(fingerprint);
+        header.records = static_cast<uint32_t>(m_names.size());
+        header.depends = static_cast<uint32_t>(m_depends.size());
+        header.strings = static_cast<uint32_t>(m_strings.size());
+        m_depends_offsets.push_back(header.depends);
+
+        std::vector<uint32_t> string_offsets = { 0 };
+        for (auto& s : m_strings)
+            string_offsets.push_back(string_offsets.back() + static_cast<uint32_t>(s.size()));
+
+        std::string data(reinterpret_cast<const char*>(&header), sizeof(header));
+        append(data, m_timestamps);
+        for (auto* column : { &m_names, &m_versions, &m_builds, &m_fns, &m_build_numbers, &m_depends_offsets, &m_depends, &string_offsets })
+            append(data, *column);
+        for (auto& s : m_strings)
+            data += s;
+
+        // Sessions holding the repodata lock shared may build the same index.
+        fs::path tmp = path;
+        tmp += ".tmp" + std::to_string(getpid());
+        write_file(tmp, data);
+        fs::rename(tmp, path);
+    }
+
+private:
+    template <class T>
+    static void append(std::string& data, const std::vector<T>& column)
+    {
+        data.append(reinterpret_cast<const char*>(column.data()), column.size() * sizeof(T));
+    }
+
+    std::unordered_map<std::string, uint32_t> m_ids;
+    std::vector<std::string> m_strings;
+    std::vector<uint64_t> m_timestamps;
+    std::vector<uint32_t> m_names, m_versions, m_builds, m_fns, m_build_numbers, m_depends_offsets, m_depends;
+};
+
+class BinaryIndex
+{
+public:
+    // Every section is checked against the size of the file and every
+    // offset and string id against its section before any of them is used;
+    // a damaged index throws.
+    explicit BinaryIndex(const fs::path& path)
+        : m_file(path)
+    {
+        if (m_file.size() < sizeof(BinaryIndexHeader))
+            throw std::runtime_error("Truncated binary index " + path.string());
+        std::memcpy(&m_header, m_file.data(), sizeof(m_header));
+        if (std::memcmp(m_header.magic, "RBI1", 4) != 0 || m_header.version != binary_index_version)
+            throw std::runtime_error("Not a binary index: " + path.string());
+
+        uint64_t n = m_header.records;
+        uint64_t sections = n * sizeof(uint64_t) + (6 * n + 1) * sizeof(uint32_t)
+                            + (uint64_t(m_header.depends) + m_header.strings + 1) * sizeof(uint32_t);
+        if (sections > m_file.size() - sizeof(m_header))
+            throw std::runtime_error("Truncated binary index " + path.string());
+
+        const char* p = m_file.data() + sizeof(m_header);
+        m_timestamps = reinterpret_cast<const uint64_t*>(p);
+        p += n * sizeof(uint64_t);
+        for (auto* column : { &m_names, &m_versions, &m_builds, &m_fns, &m_build_numbers })
+        {
+            *column = reinterpret_cast<const uint32_t*>(p);
+            p += n * sizeof(uint32_t);
+        }
+        m_depends_offsets = reinterpret_cast<const uint32_t*>(p);
+        p += (n + 1) * sizeof(uint32_t);
+        m_depends = reinterpret_cast<const uint32_t*>(p);
+        p += m_header.depends * sizeof(uint32_t);
+        m_string_offsets = reinterpret_cast<const uint32_t*>(p);
+        p += (m_header.strings + 1) * sizeof(uint32_t);
+        m_string_data = p;
+
+        auto corrupted = [&path]() { return std::runtime_error("Corrupted binary index " + path.string()); };
+        std::size_t string_bytes = static_cast<std::size_t>(m_file.data() + m_file.size() - m_string_data);
+        if (m_string_offsets[0] != 0 || m_string_offsets[m_header.strings] != string_bytes)
+            throw corrupted();
+        for (uint32_t i = 0; i < m_header.strings; ++i)
+        {
+            if (m_string_offsets[i] > m_string_offsets[i + 1])
+                throw corrupted();
+        }
+        if (m_depends_offsets[0] != 0 || m_depends_offsets[n] != m_header.depends)
+            throw corrupted();
+        auto valid_id = [this](uint32_t id) { return id < m_header.strings; };
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            if (m_depends_offsets[i] > m_depends_offsets[i + 1] || !valid_id(m_names[i]) || !valid_id(m_versions[i])
+                || !valid_id(m_builds[i]) || !valid_id(m_fns[i]))
+                throw corrupted();
+        }
+        if (!std::all_of(m_depends, m_depends + m_header.depends, valid_id) || !valid_id(m_header.fingerprint))
+            throw corrupted();
+    }
+
+    std::size_t size() const
+    {
+        return m_header.records;
+    }
+
+    std::string string(uint32_t id) const
+    {
+        return std::string(m_string_data + m_string_offsets[id], m_string_offsets[id + 1] - m_string_offsets[id]);
+    }
+
+    const char* c_str(uint32_t id, std::size_t& length) const
+    {
+        length = m_string_offsets[id + 1] - m_string_offsets[id];
+        return m_string_data + m_string_offsets[id];
+    }
+
+    std::string fingerprint() const { return string(m_header.fingerprint); }
+    uint32_t name_id(std::size_t i) const { return m_names[i]; }
+    std::string name(std::size_t i) const { return string(m_names[i]); }
+    std::string version(std::size_t i) const { return string(m_versions[i]); }
+    std::string build(std::size_t i) const { return string(m_builds[i]); }
+    std::string fn(std::size_t i) const { return string(m_fns[i]); }
+    uint32_t build_number(std::size_t i) const { return m_build_numbers[i]; }
+    uint64_t timestamp(std::size_t i) const { return m_timestamps[i]; }
+
+    std::vector<std::string> depends(std::size_t i) const
+    {
+        std::vector<std::string> deps;
+        for (uint32_t d = m_depends_offsets[i]; d < m_depends_offsets[i + 1]; ++d)
+            deps.push_back(string(m_depends[d]));
+        return deps;
+    }
+
+private:
+    MappedFile m_file;
+    BinaryIndexHeader m_header;
+    const uint64_t* m_timestamps = nullptr;
+    const uint32_t* m_names = nullptr;
+    const uint32_t* m_versions = nullptr;
+    const uint32_t* m_builds = nullptr;
+    const uint32_t* m_fns = nullptr;
+    const uint32_t* m_build_numbers = nullptr;
+    const uint32_t* m_depends_offsets = nullptr;
+    const uint32_t* m_depends = nullptr;
+    const uint32_t* m_string_offsets = nullptr;
+    const char* m_string_data = nullptr;
+};
+
+bool binary_index_fresh(const CacheEntry& entry)
+{
+    fs::path path = binary_index_path(entry);
+    if (!fs::exists(path))
+        return false;
+    try
+    {
+        return BinaryIndex(path).fingerprint() == cache_fingerprint(entry);
+    }
+    catch (const std::exception&)
+    {
+        return false;
+    }
+}
+
+bool build_binary_index(const CacheEntry& entry)
+{
+    if (binary_index_fresh(entry))
+        return false;
+
+    BinaryIndexWriter writer;
+    RepodataScanner scanner(entry.source_file);
+    scanner.scan([](const std::string&, const char*, const char*) {},
+                 [&](const std::string&, const std::string& fn, const char* begin, const char* end) {
+                     writer.add(scanner, begin, end, fn);
+                 });
+    writer.write(binary_index_path(entry), cache_fingerprint(entry));
+    return true;
+}
+
+// Binary indexes a daemon keeps mapped for the workers it forks, by path:
+// those still fresh are neither checked nor mapped again.
+std::map<std::string, std::shared_ptr<BinaryIndex>> warm_indexes;
+
+// Binary indexes of the repodata solves currently use, of the configured
+// channels or the snapshot, built when missing, stale or damaged.
+std::vector<std::pair<CacheEntry, std::shared_ptr<BinaryIndex>>> load_binary_indexes()
+{
+    std::vector<std::pair<CacheEntry, std::shared_ptr<BinaryIndex>>> indexes;
+    FileLock lock(repodata_lock_path(), "repodata", false);
+    auto snapshot = config_values.find("snapshot");
+    std::vector<CacheEntry> entries;
+    if (snapshot != config_values.end() && !snapshot->second.empty())
+    {
+        entries = snapshot_entries(snapshot_path(snapshot->second));
+    }
+    else
+    {
+        for (auto& entry : channel_entries())
+        {
+            if (fs::exists(entry.source_file))
+                entries.push_back(entry);
+        }
+    }
+    std::vector<std::shared_ptr<BinaryIndex>> warm(entries.size());
+    for (std::size_t i = 0; i < entries.size(); ++i)
+    {
+        auto it = warm_indexes.find(binary_index_path(entries[i]).string());
+        if (it != warm_indexes.end() && it->second->fingerprint() == cache_fingerprint(entries[i]))
+            warm[i] = it->second;
+    }
+    parallel_for(entries.size(), [&entries, &warm](std::size_t i) {
+        if (!warm[i])
+            build_binary_index(entries[i]);
+    });
+    for (std::size_t i = 0; i < entries.size(); ++i)
+    {
+        std::shared_ptr<BinaryIndex> index = warm[i];
+        if (!index)
+        {
+            try
+            {
+                index = std::make_shared<BinaryIndex>(binary_index_path(entries[i]));
+            }
+            catch (const std::runtime_error&)
+            {
+                // Damaged since it was checked.
+                fs::remove(binary_index_path(entries[i]));
+                build_binary_index(entries[i]);
+                index = std::make_shared<BinaryIndex>(binary_index_path(entries[i]));
+            }
+        }
+        indexes.emplace_back(entries[i], std::move(index));
+    }
+    return indexes;
+}
+
+// Specs of the pinned file libmamba applies to every solve in a prefix, one
+// per line; comments are kept when it is edited.
+fs::path pinned_file(const fs::path& prefix)
+{
+    return prefix / "conda-meta" / "pinned";
+}
+
+std::vector<std::string> pinned_lines(const fs::path& prefix)
+{
+    std::vector<std::string> lines;
+    std::ifstream in(pinned_file(prefix).string());
+    std::string line;
+    while (std::getline(in, line))
+    {
+        line.erase(line.find_last_not_of(" \t\r") + 1);
+        lines.push_back(line);
+    }
+    return lines;
+}
+
+std::vector<std::string> read_pins(const fs::path& prefix)
+{
+    std::vector<std::string> pins;
+    for (auto& line : pinned_lines(prefix))
+    {
+        std::size_t start = line.find_first_not_of(" \t");
+        if (start != std::string::npos && line[start] != '#')
+            pins.push_back(line.substr(start));
+    }
+    return pins;
+}
+
+// Rewrites the pinned file without the pins on `names`, then with `added`.
+void edit_pins(const char* prefix, const std::vector<std::string>& names, const std::vector<std::string>& added)
+{
+    fs::path target = resolve_prefix(prefix);
+    if (!fs::exists(target / "conda-meta"))
+        r::stop("No environment at " + target.string());
+    FileLock lock(prefix_lock_path(target), "prefix");
+
+    std::unordered_set<std::string> removed;
+    for (auto& name : names)
+        removed.insert(spec_name(name));
+    std::string content;
+    for (auto& line : pinned_lines(target))
+    {
+        std::size_t start = line.find_first_not_of(" \t");
+        bool pin = start != std::string::npos && line[start] != '#';
+        if (!pin || !removed.count(spec_name(line)))
+            content += line + "\n";
+    }
+    for (auto& spec : added)
+        content += spec + "\n";
+    write_file(pinned_file(target), content);
+}
+
+// What a pin allows of its package: a version constraint and a build string
+// pattern, empty for any.
+struct PinConstraint
+{
+    std::string version;
+    std::string build;
+};
+
+// Reads a pin as a match spec: "name 1.2.* build", "name=1.2=build" or
+// "name >=1.2,<2". False for the forms it does not read, such as brackets.
+bool parse_pin(const std::string& pin, std::string& name, PinConstraint& constraint)
+{
+    std::string rest = pin;
+    std::size_t channel = rest.find("::");
+    if (channel != std::string::npos)
+        rest = rest.substr(channel + 2);
+    rest.erase(0, rest.find_first_not_of(" \t"));
+    name = spec_name(rest);
+    rest.erase(0, name.size());
+    if (name.empty() || rest.find('[') != std::string::npos)
+        return false;
+
+    std::vector<std::string> words;
+    std::istringstream split(rest);
+    for (std::string word; split >> word;)
+        words.push_back(word);
+    if (words.size() > 2)
+        return false;
+    constraint = PinConstraint();
+    if (words.empty())
+        return true;
+    if (words[0].find_first_not_of("<>=!~") == std::string::npos)
+        return false;
+    constraint.version = words[0];
+    if (words.size() == 2)
+        constraint.build = words[1];
+
+    // "=1.2=build" and "==1.2=build" carry the build after the version.
+    std::size_t op = constraint.version.find_first_not_of('=');
+    if (op <= 2 && constraint.version.find_first_of("<>!~,|") == std::string::npos)
+    {
+        std::size_t build = constraint.version.find('=', op);
+        if (build != std::string::npos)
+        {
+            if (words.size() == 2)
+                return false;
+            // "=1.2" keeps the sub-versions of 1.2 too: pruning stays on the
+            // safe side of what the solver reads as exactly 1.2.
+            constraint.build = constraint.version.substr(build + 1);
+            constraint.version.erase(build);
+        }
+    }
+    return true;
+}
+
+// Whether a record of the package satisfies all its pins.
+bool pins_allow(const std::vector<PinConstraint>& constraints, const json& record)
+{
+    std::string version = record.value("version", "");
+    std::string build = record.value("build", "");
+    for (auto& constraint : constraints)
+    {
+        if (!constraint.version.empty() && !version_matches(version, constraint.version))
+            return false;
+        if (!constraint.build.empty() && !glob_match(constraint.build.c_str(), build.c_str()))
+            return false;
+    }
+    return true;
+}
+
+bool repodata_subset_needed()
+{
+    auto snapshot = config_values.find("snapshot");
+    bool frozen = snapshot != config_values.end() && !snapshot->second.empty();
+    return setting_enabled("sharded_repodata") || RepodataFilter().active() || frozen;
+}
+
+fs::path subset_cache_dir(const std::string& key)
+{
+    return rhumba_dir() / "subsets" / key;
+}
+
+// Identifies the subsets computed from `entries`: the fingerprint of their
+// repodata, and everything the filtering depends on.
+std::string subset_cache_key(const std::vector<CacheEntry>& entries, bool sharded, const RepodataFilter& filter,
+                             std::vector<std::string> seeds,
+                             const std::map<std::string, std::vector<PinConstraint>>& pinned)
+{
+    Sha256 key;
+    key.update(sharded ? "sharded\n" : "full\n");
+    for (auto& entry : entries)
+    {
+        key.update(entry.source_file.string() + "\n" + cache_fingerprint(entry));
+    }
+    std::sort(seeds.begin(), seeds.end());
+    seeds.erase(std::unique(seeds.begin(), seeds.end()), seeds.end());
+    auto add = [&key](const std::vector<std::string>& values) {
+        for (auto& value : values)
+            key.update(value + ",");
+        key.update("\n");
+    };
+    add(filter.allow);
+    add(filter.deny);
+    add(seeds);
+    for (auto& [name, constraints] : pinned)
+    {
+        for (auto& constraint : constraints)
+            key.update(name + " " + constraint.version + " " + constraint.build + "\n");
+    }
+    return key.hexdigest();
+}
+
+// Writes the subsets as the repodata cache of a package cache of their own.
+// Its urls.txt is read-only, so that libmamba downloads packages and fresh
+// repodata into the next package cache, the shared one, instead. The index is
+// written last, a directory without one is incomplete.
+void store_subsets(const fs::path& dir, const std::vector<CacheEntry>& entries, const std::vector<std::string>& repodata,
+                   const std::vector<double>& totals, const std::vector<double>& kept)
+{
+    fs::path tmp = dir;
+    tmp += ".tmp" + std::to_string(getpid());
+    fs::remove_all(tmp);
+    fs::create_directories(tmp / "cache");
+    json index = json::array();
+    for (std::size_t i = 0; i < repodata.size(); ++i)
+    {
+        std::string file = entries[i].json_file.filename().string();
+        write_file(tmp / "cache" / file, repodata[i]);
+        index.push_back({ { "file", file }, { "records", totals[i] }, { "kept", kept[i] } });
+    }
+    write_file(tmp / "urls.txt", "");
+    fs::permissions(tmp / "urls.txt", fs::perms::owner_read | fs::perms::group_read | fs::perms::others_read);
+    write_file(tmp / "index.json", index.dump());
+
+    // Another session may have stored the same subsets meanwhile.
+    if (fs::exists(dir) && !fs::exists(dir / "index.json"))
+        fs::remove_all(dir);
+    std::error_code ec;
+    fs::rename(tmp, dir, ec);
+    if (ec)
+        fs::remove_all(tmp);
+
+    // Keeps the 16 most recent combinations, and any used in the last hour,
+    // which the solve of another session may be loading.
+    std::vector<std::pair<fs::file_time_type, fs::path>> dirs;
+    for (auto& file : fs::directory_iterator(dir.parent_path()))
+        dirs.emplace_back(fs::last_write_time(file.path()), file.path());
+    if (dirs.size() <= 16)
+        return;
+    std::sort(dirs.rbegin(), dirs.rend());
+    for (std::size_t i = 16; i < dirs.size(); ++i)
+    {
+        if (seconds_since(dirs[i].first) > 3600)
+            fs::remove_all(dirs[i].second);
+    }
+}
+
+// Cache files whose repodata the current solve loads as a subset.
+std::set<std::string> subset_loads;
+
+// libmamba loads repodata from the caches of the package caches in pkgs_dirs,
+// the first fresh copy winning. For the duration of a solve, the package cache
+// holding the subsets rhumba computed comes first, and the shared cache is
+// left as it is for the other sessions.
+class RepodataSubset
+{
+public:
+    RepodataSubset(const std::vector<std::string>& specs, const char* prefix)
+    {
+        if (!repodata_subset_needed())
+            return;
+        bool sharded = setting_enabled("sharded_repodata");
+        RepodataFilter filter;
+        auto snapshot = config_values.find("snapshot");
+        bool frozen = snapshot != config_values.end() && !snapshot->second.empty();
+
+        std::vector<std::unique_ptr<RemoteShards>> remote;
+        if (frozen)
+        {
+            // Solve against the snapshot's channels only, and never refresh
+            // what it provides.
+            m_entries = snapshot_entries(snapshot_path(snapshot->second));
+            std::vector<std::string> channels;
+            for (auto& entry : m_entries)
+            {
+                if (std::find(channels.begin(), channels.end(), entry.channel) == channels.end())
+                    channels.push_back(entry.channel);
+            }
+            std::string joined;
+            for (auto& channel : channels)
+                joined += (joined.empty() ? "" : ",") + channel;
+            m_channels = std::make_unique<ScopedConfig>("channels", joined);
+            m_ttl = std::make_unique<ScopedConfig>("local_repodata_ttl", "999999999");
+            remote.resize(m_entries.size());
+        }
+        else
+        {
+            // Channels whose cache is missing or expired are served from
+            // the shards they publish, if any, so their full repodata is
+            // neither downloaded nor parsed. The others are cut from the
+            // cache.
+            auto channel_ttls = read_channel_ttls();
+            for (auto& entry : channel_entries())
+            {
+                bool cached = fs::exists(entry.json_file);
+                double ttl = repodata_ttl(entry, channel_ttls);
+                std::unique_ptr<RemoteShards> shards;
+                if (sharded && (!cached || seconds_since(fs::last_write_time(entry.json_file)) > ttl))
+                {
+                    shards = std::make_unique<RemoteShards>(entry.url, ttl);
+                    if (!shards->available())
+                        shards.reset();
+                }
+                if (!cached && !shards)
+                    continue;
+                m_entries.push_back(entry);
+                remote.push_back(std::move(shards));
+            }
+        }
+
+        std::vector<std::string> seeds = filter.seeds;
+        for (auto& spec : specs)
+            seeds.push_back(spec_name(spec));
+        for (auto& rec : read_prefix_records(resolve_prefix(prefix)))
+            seeds.push_back(rec.name);
+
+        // All the pins on a name hold together. A name with a pin that cannot
+        // be read is left to the solver.
+        std::map<std::string, std::vector<PinConstraint>> pinned;
+        std::set<std::string> unread;
+        for (auto& pin : read_pins(resolve_prefix(prefix)))
+        {
+            std::string name;
+            PinConstraint constraint;
+            if (parse_pin(pin, name, constraint))
+                pinned[name].push_back(constraint);
+            else
+                unread.insert(name.empty() ? spec_name(pin) : name);
+        }
+        for (auto& name : unread)
+            pinned.erase(name);
+
+        // The subsets only change with the repodata, the filters, the names
+        // the closure starts from and the pins, so they are computed once
+        // for each combination. Published shards are cached on their own.
+        fs::path cached;
+        bool local = std::none_of(remote.begin(), remote.end(), [](const std::unique_ptr<RemoteShards>& shards) {
+            return shards != nullptr;
+        });
+        if (local)
+        {
+            bool closure = sharded || !filter.seeds.empty();
+            cached = subset_cache_dir(
+                subset_cache_key(m_entries, sharded, filter, closure ? seeds : std::vector<std::string>{}, pinned));
+            if (fs::exists(cached / "index.json"))
+            {
+                fs::last_write_time(cached, fs::file_time_type::clock::now());
+                use_subsets(cached, remote, frozen);
+                return;
+            }
+        }
+
+        std::vector<json> subsets;
+        std::vector<double> totals;
+        if (sharded)
+        {
+            std::vector<json> headers(m_entries.size());
+            totals.resize(m_entries.size());
+            parallel_for(m_entries.size(), [&](std::size_t i) {
+                if (remote[i])
+                    return;
+                build_shards(m_entries[i]);
+                headers[i] = parse_json_file(shards_dir(m_entries[i]) / ".header.json");
+                totals[i] = std::stod(read_file(shards_dir(m_entries[i]) / ".records"));
+            });
+            for (std::size_t i = 0; i < m_entries.size(); ++i)
+            {
+                if (!remote[i])
+                    continue;
+                headers[i] = remote[i]->header();
+                headers[i]["_url"] = m_entries[i].url;
+                totals[i] = remote[i]->records();
+            }
+
+            auto lookup = [this, &remote](std::size_t i, const std::string& name) {
+                if (remote[i])
+                    return remote[i]->lookup(name);
+                fs::path shard = shards_dir(m_entries[i]) / (name + ".json");
+                return fs::exists(shard) ? parse_json_file(shard) : json();
+            };
+            auto prefetch = [&remote](const std::vector<std::string>& names) {
+                for (auto& shards : remote)
+                {
+                    if (shards)
+                        shards->prefetch(names);
+                }
+            };
+            subsets = dependency_closure(headers, seeds, filter, lookup, prefetch);
+        }
+        else
+        {
+            // Only the records that make it into a subset are parsed.
+            std::vector<json> headers(m_entries.size());
+            std::vector<std::unique_ptr<RawRepodata>> repodata(m_entries.size());
+            totals.resize(m_entries.size());
+            parallel_for(m_entries.size(), [&](std::size_t i) {
+                repodata[i] = std::make_unique<RawRepodata>(m_entries[i].source_file);
+                headers[i] = repodata[i]->header;
+                totals[i] = static_cast<double>(repodata[i]->records);
+            });
+
+            if (filter.seeds.empty())
+            {
+                // Name patterns only, no closure to compute.
+                for (std::size_t i = 0; i < headers.size(); ++i)
+                {
+                    for (auto& [name, records] : repodata[i]->by_name)
+                    {
+                        if (!filter.accepts(name))
+                            continue;
+                        json parsed = repodata[i]->parse(records);
+                        for (auto& [key, by_fn] : parsed.items())
+                            headers[i][key].update(by_fn);
+                    }
+                }
+                subsets = std::move(headers);
+            }
+            else
+            {
+                auto lookup = [&repodata](std::size_t i, const std::string& name) {
+                    auto it = repodata[i]->by_name.find(name);
+                    return it == repodata[i]->by_name.end() ? json() : repodata[i]->parse(it->second);
+                };
+                subsets = dependency_closure(headers, seeds, filter, lookup, [](const std::vector<std::string>&) {});
+            }
+        }
+
+        // Versions the environment's pins rule out can never be picked, the
+        // solver does not need to see them.
+        if (!pinned.empty())
+        {
+            for (auto& subset : subsets)
+            {
+                for (const char* key : { "packages", "packages.conda" })
+                {
+                    if (!subset.contains(key))
+                        continue;
+                    std::vector<std::string> excluded;
+                    for (auto& [fn, record] : subset[key].items())
+                    {
+                        auto pin = pinned.find(record.value("name", ""));
+                        if (pin != pinned.end() && !pins_allow(pin->second, record))
+                            excluded.push_back(fn);
+                    }
+                    for (auto& fn : excluded)
+                        subset[key].erase(fn);
+                }
+            }
+        }
+
+        std::vector<std::string> repodata;
+        std::vector<double> kept;
+        Sha256 all;
+        for (std::size_t i = 0; i < subsets.size(); ++i)
+        {
+            kept.push_back(static_cast<double>(record_count(subsets[i])));
+            // Header keys start with an underscore and sort first, where
+            // libmamba expects them.
+            repodata.push_back(subsets[i].dump());
+            all.update(m_entries[i].json_file.filename().string() + "\n" + repodata.back());
+        }
+        if (!local)
+            cached = subset_cache_dir(all.hexdigest());
+        store_subsets(cached, m_entries, repodata, totals, kept);
+        use_subsets(cached, remote, frozen);
+    }
+
+    // A revalidation answered with 304 only touched the subset, the shared
+    // cache it was cut from is dated along, as libmamba would have.
+    ~RepodataSubset()
+    {
+        subset_loads.clear();
+        for (std::size_t i = 0; i < m_subsets.size(); ++i)
+        {
+            if (m_subsets[i].empty())
+                continue;
+            std::error_code ec;
+            auto checked = fs::last_write_time(m_subsets[i], ec);
+            auto original = fs::last_write_time(m_entries[i].json_file, ec);
+            if (ec || checked <= original)
+                continue;
+            bool fresh_solv = fs::exists(m_entries[i].solv_file, ec)
+                              && fs::last_write_time(m_entries[i].solv_file, ec) >= original;
+            fs::last_write_time(m_entries[i].json_file, checked, ec);
+            if (fresh_solv)
+                fs::last_write_time(m_entries[i].solv_file, checked, ec);
+        }
+    }
+
+    RepodataSubset(const RepodataSubset&) = delete;
+    RepodataSubset& operator=(const RepodataSubset&) = delete;
+
+private:
+    // Each subset is dated like the cache it was cut from, so that libmamba
+    // revalidates it exactly when it would have revalidated the full
+    // repodata; those built from shards just checked are dated now. The .solv
+    // libmamba wrote next to a subset before stays valid, its content is the
+    // same.
+    void use_subsets(const fs::path& dir, const std::vector<std::unique_ptr<RemoteShards>>& remote, bool frozen)
+    {
+        json index = parse_json_file(dir / "index.json");
+        last_filter_stats.clear();
+        double total_kept = 0, total = 0;
+        for (std::size_t i = 0; i < m_entries.size(); ++i)
+        {
+            FilterStats stats;
+            stats.channel = m_entries[i].channel;
+            stats.subdir = m_entries[i].subdir;
+            stats.records = index[i]["records"];
+            stats.kept = index[i]["kept"];
+            last_filter_stats.push_back(stats);
+            total_kept += stats.kept;
+            total += stats.records;
+
+            fs::path json_file = dir / "cache" / index[i]["file"].get<std::string>();
+            fs::path solv_file = fs::path(json_file).replace_extension(".solv");
+            bool dated = !frozen && !remote[i];
+            m_subsets.push_back(dated ? json_file : fs::path());
+            subset_loads.insert(m_entries[i].json_file.string());
+            auto mtime = dated ? fs::last_write_time(m_entries[i].json_file) : fs::file_time_type::clock::now();
+            if (frozen || fs::last_write_time(json_file) == mtime)
+                continue;
+            bool fresh_solv = fs::exists(solv_file) && fs::last_write_time(solv_file) >= fs::last_write_time(json_file);
+            fs::last_write_time(json_file, mtime);
+            if (fresh_solv)
+                fs::last_write_time(solv_file, mtime);
+        }
+        r::Rcout << "Loading " << total_kept << " of " << total << " repodata records" << std::endl;
+
+        std::string dirs = dir.string();
+        for (auto& pkgs : pkgs_dirs())
+            dirs += "," + pkgs.string();
+        m_pkgs_dirs = std::make_unique<ScopedConfig>("pkgs_dirs", dirs);
+    }
+
+    std::vector<CacheEntry> m_entries;
+    std::vector<fs::path> m_subsets;
+    std::unique_ptr<ScopedConfig> m_channels;
+    std::unique_ptr<ScopedConfig> m_ttl;
+    std::unique_ptr<ScopedConfig> m_pkgs_dirs;
+};
+
+// [[Rcpp::export]]
+void print_config()
+{
+    mamba_use_conda_root_prefix();
+    mamba_config_list();
+}
+
+// [[Rcpp::export]]
+void list(const char* regex = "", const char* prefix = "")
+{
+    if (!daemon_socket.empty())
+        return delegate({ { "command", "list" }, { "regex", regex }, { "prefix", prefix } });
+
+    mamba_use_conda_root_prefix();
+    FileLock lock(prefix_lock_path(resolve_prefix(prefix)), "prefix", false);
+    set_prefix(prefix);
+    mamba_list(regex);
+}
+
+// [[Rcpp::export]]
+void clone(const char* source_prefix, const char* new_prefix)
+{
+    fs::path src = resolve_prefix(source_prefix);
+    fs::path dst = resolve_prefix(new_prefix);
+
+    FileLock source_lock(prefix_lock_path(src), "prefix", false);
+    FileLock target_lock(prefix_lock_path(dst), "prefix");
+    if (!fs::exists(src / "conda-meta"))
+        r::stop(src.string() + " is not an environment");
+    if (fs::exists(dst) && !fs::is_empty(dst))
+        r::stop(dst.string() + " already exists");
+
+    clone_prefix(src, dst);
+}
+
+// [[Rcpp::export]]
+void register_template(const char* name, const char* prefix)
+{
+    fs::path path = resolve_prefix(prefix);
+    FileLock registry_lock(templates_lock_path(), "template");
+    FileLock prefix_lock(prefix_lock_path(path), "prefix", false);
+    if (!fs::exists(path / "conda-meta"))
+        r::stop(path.string() + " is not an environment");
+
+    verify_template(name, path);
+    json registry = read_templates();
+    registry[name] = path.string();
+    write_file(templates_file(), registry.dump(4));
+}
+
+// [[Rcpp::export]]
+void unregister_template(const char* name)
+{
+    FileLock registry_lock(templates_lock_path(), "template");
+    json registry = read_templates();
+    registry.erase(name);
+    write_file(templates_file(), registry.dump(4));
+    fs::remove(template_manifest_file(name));
+}
+
+// [[Rcpp::export]]
+r::DataFrame templates()
+{
+    FileLock registry_lock(templates_lock_path(), "template", false);
+    std::vector<std::string> names, prefixes;
+    json registry = read_templates();
+    for (auto& [name, prefix] : registry.items())
+    {
+        names.push_back(name);
+        prefixes.push_back(prefix.get<std::string>());
+    }
+    return r::DataFrame::create(r::Named("name") = names,
+                                r::Named("prefix") = prefixes,
+                                r::Named("stringsAsFactors") = false);
+}
+
+// [[Rcpp::export]]
+void use_store(const char* path)
+{
+    shared_store = *path ? resolve_prefix(path).string() : "";
+    if (shared_store.empty())
+        return;
+
+    fs::create_directories(fs::path(shared_store) / "objects");
+    fs::create_directories(fs::path(shared_store) / "pkgs");
+    set_config("pkgs_dirs", std::vector<std::string>{ (fs::path(shared_store) / "pkgs").string() });
+}
+
+// [[Rcpp::export]]
+r::List store_link(const char* prefix = "", const char* store = "")
+{
+    FileLock lock(store_root(store) / "rhumba.lock", "store", false);
+    auto stats = link_prefix_to_store(resolve_prefix(prefix), store_root(store));
+    return r::List::create(r::Named("linked") = static_cast<double>(stats.linked),
+                           r::Named("added") = static_cast<double>(stats.added),
+                           r::Named("skipped") = static_cast<double>(stats.skipped),
+                           r::Named("bytes_saved") = static_cast<double>(stats.bytes_saved));
+}
+
+// [[Rcpp::export]]
+r::List store_status(const char* store = "")
+{
+    FileLock lock(store_root(store) / "rhumba.lock", "store", false);
+    fs::path objects = store_root(store) / "objects";
+    auto linked = store_references(store_root(store));
+    double count = 0, bytes = 0, references = 0, unreferenced = 0, unreferenced_bytes = 0;
+    if (fs::exists(objects))
+    {
+        for (auto& entry : fs::recursive_directory_iterator(objects))
+        {
+            if (!entry.is_regular_file())
+                continue;
+            double size = static_cast<double>(entry.file_size());
+            auto found = linked.find(entry.path().string());
+            double links = found == linked.end() ? 0 : static_cast<double>(found->second);
+            count += 1;
+            bytes += size;
+            references += links;
+            if (links == 0)
+            {
+                unreferenced += 1;
+                unreferenced_bytes += size;
+            }
+        }
+    }
+    return r::List::create(r::Named("objects") = count,
+                           r::Named("bytes") = bytes,
+                           r::Named("references") = references,
+                           r::Named("unreferenced") = unreferenced,
+                           r::Named("unreferenced_bytes") = unreferenced_bytes);
+}
+
+// [[Rcpp::export]]
+r::List store_gc(const char* store = "")
+{
+    FileLock lock(store_root(store) / "rhumba.lock", "store");
+    fs::path objects = store_root(store) / "objects";
+    double removed = 0, bytes = 0;
+
+    // Forget prefixes that were deleted since they were linked.
+    std::string registered;
+    for (auto& prefix : store_prefixes(store_root(store)))
+    {
+        if (fs::exists(prefix / "conda-meta"))
+            registered += prefix.string() + "\n";
+    }
+    write_file(store_prefixes_file(store_root(store)), registered);
+
+    if (fs::exists(objects))
+    {
+        auto linked = store_references(store_root(store));
+        std::vector<fs::path> garbage;
+        for (auto& entry : fs::recursive_directory_iterator(objects))
+        {
+            if (entry.is_regular_file() && !linked.count(entry.path().string()))
+                garbage.push_back(entry.path());
+        }
+        for (auto& path : garbage)
+        {
+            bytes += static_cast<double>(fs::file_size(path));
+            fs::remove(path);
+            removed += 1;
+        }
+    }
+    return r::List::create(r::Named("removed") = removed, r::Named("bytes") = bytes);
+}
+
+// [[Rcpp::export]]
+r::DataFrame lock_stats()
+{
+    std::vector<std::string> kinds;
+    std::vector<double> acquired, contended, wait_seconds, max_wait_seconds;
+    for (auto& [kind, stats] : lock_stats_by_kind)
+    {
+        kinds.push_back(kind);
+        acquired.push_back(stats.acquired);
+        contended.push_back(stats.contended);
+        wait_seconds.push_back(stats.wait_seconds);
+        max_wait_seconds.push_back(stats.max_wait_seconds);
+    }
+    return r::DataFrame::create(r::Named("lock") = kinds,
+                                r::Named("acquired") = acquired,
+                                r::Named("contended") = contended,
+                                r::Named("wait_seconds") = wait_seconds,
+                                r::Named("max_wait_seconds") = max_wait_seconds,
+                                r::Named("stringsAsFactors") = false);
+}
+
+// [[Rcpp::export]]
+std::vector<std::string> pins(const char* prefix = "")
+{
+    mamba_use_conda_root_prefix();
+    return read_pins(resolve_prefix(prefix));
+}
+
+// [[Rcpp::export]]
+void pin(const std::vector<std::string>& specs, const char* prefix = "")
+{
+    mamba_use_conda_root_prefix();
+    edit_pins(prefix, specs, specs);
+}
+
+// [[Rcpp::export]]
+void unpin(const std::vector<std::string>& names, const char* prefix = "")
+{
+    mamba_use_conda_root_prefix();
+    edit_pins(prefix, names, {});
+}
+
+// [[Rcpp::export]]
+void create(const std::vector<std::string>& specs, const char* prefix, const char* from_template = "")
+{
+    if (!daemon_socket.empty())
+        return delegate({ { "command", "create" }, { "specs", specs }, { "prefix", prefix }, { "from_template", from_template } });
+
+    mamba_use_conda_root_prefix();
+    hide_banner();
+
+    // The template is locked before the target, like the source of clone().
+    std::unique_ptr<FileLock> registry_lock, template_lock;
+    fs::path source;
+    if (*from_template)
+    {
+        registry_lock = std::make_unique<FileLock>(templates_lock_path(), "template", false);
+        source = registered_template(from_template);
+        template_lock = std::make_unique<FileLock>(prefix_lock_path(source), "prefix", false);
+    }
+    TransactionLock lock(prefix);
+    RepodataFreshness freshness;
+
+    if (*from_template)
+    {
+        fs::path target = resolve_prefix(prefix);
+        if (fs::exists(target) && !fs::is_empty(target))
+            r::stop(target.string() + " already exists");
+        check_template(from_template, source);
+        clone_prefix(source, target);
+        if (specs.empty())
+            return;
+
+        // Whatever the template already provides is a no-op for the solver.
+        RepodataSubset subset(specs, prefix);
+        set_specs(specs);
+        set_prefix(prefix);
+        run_solve("create", specs, "install");
+        link_to_shared_store(prefix);
+        return;
+    }
+
+    set_prefix(prefix);
+
+    // Keyed on the full repodata the subsets are cut from. An
+    // explicit install of a cached solution does not load repodata at all.
+    std::string key = solve_cache_key(specs);
+    fs::path solution = solve_cache_file(key);
+    fs::path target = resolve_prefix(prefix);
+    if (fs::exists(solution))
+    {
+        bool existed = fs::exists(target);
+        int status;
+        {
+            ExplicitInstall install(solution);
+            status = run_solve("create", specs, "create");
+        }
+        if (status == 0)
+        {
+            solve_cache_hits += 1;
+            link_to_shared_store(prefix);
+            return;
+        }
+
+        // Stale entry, e.g. a package was removed from its channel.
+        fs::remove(solution);
+        if (!existed)
+            fs::remove_all(target);
+    }
+    solve_cache_misses += 1;
+
+    RepodataSubset subset(specs, prefix);
+    set_specs(specs);
+    if (run_solve("create", specs, "create") == 0)
+        store_solution(key, target);
+    link_to_shared_store(prefix);
+}
+
+// [[Rcpp::export]]
+r::List solve_cache_stats()
+{
+    double entries = 0, bytes = 0;
+    fs::path dir = rhumba_dir() / "solve-cache";
+    if (fs::exists(dir))
+    {
+        for (auto& entry : fs::directory_iterator(dir))
+        {
+            entries += 1;
+            bytes += static_cast<double>(entry.file_size());
+        }
+    }
+    return r::List::create(r::Named("hits") = solve_cache_hits,
+                           r::Named("misses") = solve_cache_misses,
+                           r::Named("entries") = entries,
+                           r::Named("bytes") = bytes);
+}
+
+// [[Rcpp::export]]
+void clear_solve_cache()
+{
+    fs::remove_all(rhumba_dir() / "solve-cache");
+}
+
+fs::path index_loads_file()
+{
+    return rhumba_dir() / "index-loads.json";
+}
+
+// Whether each cached repodata file can be loaded from its .solv, or is
+// replaced by a subset, taken before a solve: libmamba writes the .solv while
+// loading the JSON.
+std::map<std::string, std::string> index_load_formats()
+{
+    std::map<std::string, std::string> formats;
+    for (auto& entry : channel_entries())
+    {
+        bool fresh_solv = fs::exists(entry.json_file) && fs::exists(entry.solv_file)
+                          && fs::last_write_time(entry.solv_file) >= fs::last_write_time(entry.json_file);
+        formats[entry.json_file.string()] = subset_loads.count(entry.json_file.string()) ? "subset"
+                                            : fresh_solv                                ? "solv"
+                                                                                        : "json";
+    }
+    return formats;
+}
+
+// When a solve of any session last loaded each cache, and from which format.
+void record_index_loads(const std::map<std::string, std::string>& formats)
+{
+    if (formats.empty())
+        return;
+    FileLock lock(rhumba_dir() / "index-loads.lock", "index loads");
+    fs::path path = index_loads_file();
+    json loads = fs::exists(path) ? parse_json_file(path) : json::object();
+    double now = std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count();
+    for (auto& [file, format] : formats)
+    {
+        if (fs::exists(file))
+            loads[file] = { { "time", now }, { "format", format } };
+    }
+    write_file(path.string() + ".tmp", loads.dump());
+    fs::rename(path.string() + ".tmp", path);
+}
+
+// [[Rcpp::export]]
+r::DataFrame index_cache_status()
+{
+    std::vector<std::string> channels, subdirs, formats, files, load_formats;
+    std::vector<double> json_sizes, solv_sizes, ages, solv_ages, ttls, load_ages;
+    auto channel_ttls = read_channel_ttls();
+    json loads = fs::exists(index_loads_file()) ? parse_json_file(index_loads_file()) : json::object();
+    double now = std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count();
+    for (auto& entry : cache_entries())
+    {
+        auto load = loads.find(entry.json_file.string());
+        if (load != loads.end())
+        {
+            load_ages.push_back(now - load->value("time", now));
+            load_formats.push_back(load->value("format", ""));
+        }
+        else
+        {
+            load_ages.push_back(NA_REAL);
+            load_formats.push_back("");
+        }
+
+        auto json_time = fs::last_write_time(entry.json_file);
+        bool has_solv = fs::exists(entry.solv_file);
+        bool fresh_solv = has_solv && fs::last_write_time(entry.solv_file) >= json_time;
+
+        channels.push_back(entry.channel);
+        subdirs.push_back(entry.subdir);
+        files.push_back(entry.json_file.string());
+        formats.push_back(fresh_solv ? "solv" : "json");
+        json_sizes.push_back(static_cast<double>(fs::file_size(entry.json_file)));
+        solv_sizes.push_back(has_solv ? static_cast<double>(fs::file_size(entry.solv_file)) : NA_REAL);
+        ages.push_back(seconds_since(json_time));
+        ttls.push_back(repodata_ttl(entry, channel_ttls));
+        solv_ages.push_back(has_solv ? seconds_since(fs::last_write_time(entry.solv_file)) : NA_REAL);
+    }
+    return r::DataFrame::create(r::Named("channel") = channels,
+                                r::Named("subdir") = subdirs,
+                                r::Named("format") = formats,
+                                r::Named("age_seconds") = ages,
+                                r::Named("ttl_seconds") = ttls,
+                                r::Named("json_size") = json_sizes,
+                                r::Named("solv_size") = solv_sizes,
+                                r::Named("solv_age_seconds") = solv_ages,
+                                r::Named("last_load_seconds") = load_ages,
+                                r::Named("last_load_format") = load_formats,
+                                r::Named("file") = files,
+                                r::Named("stringsAsFactors") = false);
+}
+
+// Loads the channels whose repodata expired under their TTL (all of them with
+// `revalidate`), or whose .solv is out of date, through a dry-run solve that
+// refreshes the repodata and writes the .solv files the next solves load from.
+// The solve works on a private copy of those caches, so that other sessions
+// keep solving against the shared ones meanwhile: each file is only renamed
+// into place once complete.
+// [[Rcpp::export]]
+r::DataFrame prebuild_index_cache(const char* spec = "r-base", const char* prefix = "", int revalidate = 0)
+{
+    mamba_use_conda_root_prefix();
+    hide_banner();
+
+    auto channel_ttls = read_channel_ttls();
+    std::vector<CacheEntry> stale;
+    std::string channels;
+    for (auto& entry : channel_entries())
+    {
+        if (!revalidate && fs::exists(entry.json_file)
+            && seconds_since(fs::last_write_time(entry.json_file)) <= repodata_ttl(entry, channel_ttls)
+            && fs::exists(entry.solv_file) && fs::last_write_time(entry.solv_file) >= fs::last_write_time(entry.json_file))
+            continue;
+        stale.push_back(entry);
+        if (("," + channels + ",").find("," + entry.channel + ",") == std::string::npos)
+            channels += (channels.empty() ? "" : ",") + entry.channel;
+    }
+    if (stale.empty())
+        return index_cache_status();
+
+    // Under the shared cache, so that the renames stay on one file system.
+    fs::path work = pkgs_dir() / "cache" / ("rhumba-refresh-" + std::to_string(getpid()));
+    fs::remove_all(work);
+    fs::create_directories(work / "cache");
+    auto copy = [](const fs::path& from, const fs::path& to) {
+        if (!fs::exists(from))
+            return;
+        fs::copy_file(from, to, fs::copy_options::overwrite_existing);
+        fs::last_write_time(to, fs::last_write_time(from));
+    };
+    auto formats = index_load_formats();
+    for (auto& entry : stale)
+    {
+        // Kept for their etag, so that unchanged repodata is not downloaded.
+        copy(entry.json_file, work / "cache" / entry.json_file.filename());
+        copy(entry.solv_file, work / "cache" / entry.solv_file.filename());
+    }
+
+    try
+    {
+        RepodataFreshness freshness(true);
+        ScopedConfig pkgs_dirs("pkgs_dirs", work.string());
+        ScopedConfig only_stale("channels", channels);
+        ScopedConfig dry_run("dry_run", "true");
+        ScopedConfig always_yes("always_yes", "true");
+        set_specs({ spec });
+        set_prefix(prefix);
+        mamba_install();
+    }
+    catch (...)
+    {
+        fs::remove_all(work);
+        throw;
+    }
+
+    {
+        // Shared, like libmamba writing the cache during a transaction.
+        FileLock lock(repodata_lock_path(), "repodata", false);
+        std::map<std::string, std::string> loaded;
+        for (auto& entry : stale)
+        {
+            fs::path json_file = work / "cache" / entry.json_file.filename();
+            fs::path solv_file = work / "cache" / entry.solv_file.filename();
+            if (!fs::exists(json_file))
+                continue;
+            fs::rename(json_file, entry.json_file);
+            if (fs::exists(solv_file))
+                fs::rename(solv_file, entry.solv_file);
+            else
+                fs::remove(entry.solv_file);
+            loaded[entry.json_file.string()] = formats[entry.json_file.string()];
+        }
+        record_index_loads(loaded);
+    }
+    fs::remove_all(work);
+    return index_cache_status();
+}
+
+// [[Rcpp::export]]
+r::DataFrame build_binary_index()
+{
+    mamba_use_conda_root_prefix();
+    std::vector<std::string> channels, subdirs;
+    std::vector<double> records, sizes;
+    for (auto& [entry, index] : load_binary_indexes())
+    {
+        channels.push_back(entry.channel);
+        subdirs.push_back(entry.subdir);
+        records.push_back(static_cast<double>(index->size()));
+        sizes.push_back(static_cast<double>(fs::file_size(binary_index_path(entry))));
+    }
+    return r::DataFrame::create(r::Named("channel") = channels,
+                                r::Named("subdir") = subdirs,
+                                r::Named("records") = records,
+                                r::Named("bytes") = sizes,
+                                r::Named("stringsAsFactors") = false);
+}
+
+// [[Rcpp::export]]
+r::DataFrame search(const char* query, const char* channel = "")
+{
+    mamba_use_conda_root_prefix();
+    std::vector<std::string> names, versions, builds, channels, subdirs, fns, depends;
+    std::vector<double> build_numbers, timestamps;
+
+    std::string pattern = query;
+    for (auto& [entry, index] : load_binary_indexes())
+    {
+        if (*channel && !channel_matches(entry.channel, channel))
+            continue;
+
+        // Names are interned, so each distinct one is matched only once.
+        std::unordered_map<uint32_t, bool> matched;
+        for (std::size_t i = 0; i < index->size(); ++i)
+        {
+            uint32_t id = index->name_id(i);
+            auto it = matched.find(id);
+            if (it == matched.end())
+                it = matched.emplace(id, glob_match(pattern.c_str(), index->string(id).c_str())).first;
+            if (!it->second)
+                continue;
+
+            std::string joined;
+            for (auto& dep : index->depends(i))
+                joined += (joined.empty() ? "" : ", ") + dep;
+            names.push_back(index->name(i));
+            versions.push_back(index->version(i));
+            builds.push_back(index->build(i));
+            build_numbers.push_back(index->build_number(i));
+            timestamps.push_back(static_cast<double>(index->timestamp(i)));
+            channels.push_back(entry.channel);
+            subdirs.push_back(entry.subdir);
+            fns.push_back(index->fn(i));
+            depends.push_back(joined);
+        }
+    }
+    return r::DataFrame::create(r::Named("name") = names,
+                                r::Named("version") = versions,
+                                r::Named("build") = builds,
+                                r::Named("build_number") = build_numbers,
+                                r::Named("timestamp") = timestamps,
+                                r::Named("channel") = channels,
+                                r::Named("subdir") = subdirs,
+                                r::Named("fn") = fns,
+                                r::Named("depends") = depends,
+                                r::Named("stringsAsFactors") = false);
+}
+
+// Whether an installed record came from the channel a cache entry is for.
+bool record_from_channel(const PrefixRecord& rec, const CacheEntry& entry)
+{
+    const std::string& origin = rec.url.empty() ? rec.channel : rec.url;
+    if (origin.empty())
+        return true;
+    return origin == entry.channel || origin.compare(0, entry.channel.size() + 1, entry.channel + "/") == 0
+           || channel_matches(entry.channel, origin);
+}
+
+// [[Rcpp::export]]
+r::DataFrame outdated(const char* prefix = "")
+{
+    mamba_use_conda_root_prefix();
+    auto records = read_prefix_records(resolve_prefix(prefix));
+    std::sort(records.begin(), records.end(), [](const PrefixRecord& a, const PrefixRecord& b) { return a.name < b.name; });
+
+    // What the installed packages require of each other bounds how far each
+    // one can move without touching the others.
+    std::unordered_map<std::string, std::vector<std::string>> constraints;
+    for (auto& rec : records)
+    {
+        for (auto& dep : rec.depends)
+        {
+            std::string version = spec_version(dep);
+            if (!version.empty())
+                constraints[spec_name(dep)].push_back(version);
+        }
+    }
+
+    struct Newest
+    {
+        std::string compatible;
+        std::string available;
+        std::string channel;
+    };
+    std::unordered_map<std::string, const PrefixRecord*> installed;
+    std::unordered_map<std::string, Newest> newest;
+    for (auto& rec : records)
+    {
+        installed[rec.name] = &rec;
+        newest[rec.name] = { rec.version, rec.version, "" };
+    }
+
+    std::string subdir = platform();
+    for (auto& [entry, index] : load_binary_indexes())
+    {
+        if (entry.subdir != subdir && entry.subdir != "noarch")
+            continue;
+
+        std::unordered_map<uint32_t, const PrefixRecord*> matched;
+        for (std::size_t i = 0; i < index->size(); ++i)
+        {
+            uint32_t id = index->name_id(i);
+            auto it = matched.find(id);
+            if (it == matched.end())
+            {
+                auto rec = installed.find(index->string(id));
+                bool same = rec != installed.end() && record_from_channel(*rec->second, entry);
+                it = matched.emplace(id, same ? rec->second : nullptr).first;
+            }
+            if (!it->second)
+                continue;
+
+            Newest& best = newest[it->second->name];
+            std::string version = index->version(i);
+            CondaVersion parsed = parse_version(version);
+            if (compare_versions(parsed, parse_version(best.available)) > 0)
+            {
+                best.available = version;
+                best.channel = entry.channel;
+            }
+            if (compare_versions(parsed, parse_version(best.compatible)) > 0)
+            {
+                auto& required = constraints[it->second->name];
+                if (std::all_of(required.begin(), required.end(), [&version](const std::string& c) { return version_matches(version, c); }))
+                    best.compatible = version;
+            }
+        }
+    }
+
+    std::vector<std::string> names, current, compatible, available, channels;
+    for (auto& rec : records)
+    {
+        const Newest& best = newest[rec.name];
+        if (best.available == rec.version)
+            continue;
+        names.push_back(rec.name);
+        current.push_back(rec.version);
+        compatible.push_back(best.compatible);
+        available.push_back(best.available);
+        channels.push_back(best.channel);
+    }
+    return r::DataFrame::create(r::Named("name") = names,
+                                r::Named("installed") = current,
+                                r::Named("newest_compatible") = compatible,
+                                r::Named("newest_available") = available,
+                                r::Named("channel") = channels,
+                                r::Named("stringsAsFactors") = false);
+}
+
+// Collects the top-level string fields it is asked for and stops parsing as
+// soon as it has them, before e.g. the file lists of a conda-meta record.
+// Stopping early is not an error: a malformed file sets error() instead.
+class FieldsSax : public nlohmann::json_sax<json>
+{
+public:
+    explicit FieldsSax(std::map<std::string, std::string>& fields)
+        : m_fields(fields)
+        , m_missing(fields.size())
+    {
+    }
+
+    bool null() override { return true; }
+    bool boolean(bool) override { return true; }
+    bool number_integer(number_integer_t) override { return true; }
+    bool number_unsigned(number_unsigned_t) override { return true; }
+    bool number_float(number_float_t, const string_t&) override { return true; }
+    bool binary(binary_t&) override { return true; }
+    bool start_object(std::size_t) override { ++m_depth; return true; }
+    bool end_object() override { --m_depth; return true; }
+    bool start_array(std::size_t) override { ++m_depth; return true; }
+    bool end_array() override { --m_depth; return true; }
+
+    bool key(string_t& k) override
+    {
+        if (m_depth == 1)
+            m_key = k;
+        return true;
+    }
+
+    bool string(string_t& value) override
+    {
+        auto it = m_fields.find(m_key);
+        if (m_depth == 1 && it != m_fields.end())
+        {
+            it->second = value;
+            --m_missing;
+        }
+        return m_missing > 0;
+    }
+
+    bool parse_error(std::size_t, const std::string&, const nlohmann::detail::exception& e) override
+    {
+        m_error = e.what();
+        return false;
+    }
+
+    const std::string& error() const
+    {
+        return m_error;
+    }
+
+private:
+    std::map<std::string, std::string>& m_fields;
+    std::size_t m_missing;
+    int m_depth = 0;
+    std::string m_key;
+    std::string m_error;
+};
+
+struct EnvPackage
+{
+    std::string version;
+    std::string build;
+    std::string channel;
+};
+
+// "conda-forge" for https://conda.anaconda.org/conda-forge/linux-64 and the
+// like, so that records written by different tools compare equal.
+std::string short_channel(std::string channel)
+{
+    while (!channel.empty() && channel.back() == '/')
+        channel.pop_back();
+    std::size_t slash = channel.find_last_of('/');
+    if (slash != std::string::npos)
+    {
+        std::string last = channel.substr(slash + 1);
+        bool subdir = last == "noarch";
+        for (const char* os : { "linux-", "osx-", "win-", "zos-", "emscripten-", "wasi-" })
+            subdir = subdir || last.compare(0, std::strlen(os), os) == 0;
+        if (subdir)
+            channel.erase(slash);
+    }
+    for (const char* host : { "https://conda.anaconda.org/", "http://conda.anaconda.org/", "https://repo.anaconda.com/pkgs/" })
+    {
+        if (channel.compare(0, std::strlen(host), host) == 0)
+            return channel.substr(std::strlen(host));
+    }
+    return channel;
+}
+
+// Splits name-version-build[.conda|.tar.bz2|.json].
+bool split_dist(std::string dist, std::string& name, EnvPackage& package)
+{
+    for (const char* extension : { ".tar.bz2", ".conda", ".json" })
+    {
+        std::size_t n = std::strlen(extension);
+        if (dist.size() > n && dist.compare(dist.size() - n, n, extension) == 0)
+        {
+            dist.erase(dist.size() - n);
+            break;
+        }
+    }
+    std::size_t build = dist.find_last_of('-');
+    if (build == std::string::npos || build == 0)
+        return false;
+    std::size_t version = dist.find_last_of('-', build - 1);
+    if (version == std::string::npos)
+        return false;
+    name = dist.substr(0, version);
+    package.version = dist.substr(version + 1, build - version - 1);
+    package.build = dist.substr(build + 1);
+    return true;
+}
+
+// Whether `source` can name a lockfile: a path with a directory part, or a
+// file name with a lockfile extension. A bare name is an environment even if
+// a file of that name is in the working directory.
+bool lockfile_source(const std::string& source)
+{
+    fs::path path = source;
+    if (source.find('/') != std::string::npos)
+        return true;
+#ifdef _WIN32
+    if (source.find('\\') != std::string::npos)
+        return true;
+#endif
+    return path.extension() == ".txt" || path.extension() == ".lock";
+}
+
+// The packages of a prefix, or of a lockfile: an explicit file of package
+// URLs, or name=version=build lines.
+std::unordered_map<std::string, EnvPackage> env_packages(const std::string& source)
+{
+    std::unordered_map<std::string, EnvPackage> packages;
+    fs::path path = source;
+    if (lockfile_source(source) && fs::is_regular_file(path))
+    {
+        std::ifstream in(path.string());
+        std::string line;
+        while (std::getline(in, line))
+        {
+            line.erase(line.find_last_not_of(" \t\r") + 1);
+            line.erase(0, line.find_first_not_of(" \t"));
+            if (line.empty() || line[0] == '#' || line[0] == '@')
+                continue;
+
+            std::string name;
+            EnvPackage package;
+            if (line.find("://") != std::string::npos)
+            {
+                line.erase(std::min(line.find('#'), line.size()));
+                std::size_t slash = line.find_last_of('/');
+                if (slash == std::string::npos || !split_dist(line.substr(slash + 1), name, package))
+                    continue;
+                package.channel = short_channel(line.substr(0, slash));
+            }
+            else
+            {
+                std::size_t first = line.find('=');
+                std::size_t second = first == std::string::npos ? first : line.find('=', first + 1);
+                if (second == std::string::npos)
+                    continue;
+                name = line.substr(0, first);
+                package.version = line.substr(first + 1, second - first - 1);
+                package.build = line.substr(second + 1);
+            }
+            packages[name] = package;
+        }
+        return packages;
+    }
+
+    fs::path conda_meta = resolve_prefix(source.c_str()) / "conda-meta";
+    if (!fs::exists(conda_meta))
+        r::stop("No environment or lockfile at " + source);
+    for (auto& entry : fs::directory_iterator(conda_meta))
+    {
+        std::string name;
+        EnvPackage package;
+        if (entry.path().extension() != ".json" || !split_dist(entry.path().filename().string(), name, package))
+            continue;
+        std::map<std::string, std::string> fields = { { "channel", "" } };
+        FieldsSax sax(fields);
+        MappedFile file(entry.path());
+        json::sax_parse(file.data(), file.data() + file.size(), &sax);
+        if (!sax.error().empty())
+            throw std::runtime_error("Could not read " + entry.path().string() + ": " + sax.error());
+        package.channel = short_channel(fields["channel"]);
+        packages[name] = package;
+    }
+    return packages;
+}
+
+// [[Rcpp::export]]
+r::DataFrame diff_env(const char* a, const char* b)
+{
+    mamba_use_conda_root_prefix();
+    auto left = env_packages(a);
+    auto right = env_packages(b);
+
+    std::vector<std::string> names;
+    for (auto& [name, package] : left)
+        names.push_back(name);
+    for (auto& [name, package] : right)
+    {
+        if (!left.count(name))
+            names.push_back(name);
+    }
+    std::sort(names.begin(), names.end());
+
+    std::vector<std::string> changed_names, changes, versions_a, versions_b, builds_a, builds_b, channels_a, channels_b;
+    for (auto& name : names)
+    {
+        auto l = left.find(name);
+        auto match = right.find(name);
+        std::string change;
+        if (l == left.end())
+            change = "added";
+        else if (match == right.end())
+            change = "removed";
+        else if (l->second.version != match->second.version || l->second.build != match->second.build
+                 || (!l->second.channel.empty() && !match->second.channel.empty()
+                     && l->second.channel != match->second.channel))
+            change = "changed";
+        else
+            continue;
+
+        EnvPackage none;
+        const EnvPackage& from = l == left.end() ? none : l->second;
+        const EnvPackage& to = match == right.end() ? none : match->second;
+        changed_names.push_back(name);
+        changes.push_back(change);
+        versions_a.push_back(from.version);
+        versions_b.push_back(to.version);
+        builds_a.push_back(from.build);
+        builds_b.push_back(to.build);
+        channels_a.push_back(from.channel);
+        channels_b.push_back(to.channel);
+    }
+    return r::DataFrame::create(r::Named("name") = changed_names,
+                                r::Named("change") = changes,
+                                r::Named("version_a") = versions_a,
+                                r::Named("version_b") = versions_b,
+                                r::Named("build_a") = builds_a,
+                                r::Named("build_b") = builds_b,
+                                r::Named("channel_a") = channels_a,
+                                r::Named("channel_b") = channels_b,
+                                r::Named("stringsAsFactors") = false);
+}
+
+// Both methods extract the same fields of every record. The numbers cover
+// rhumba's own reading of repodata only: libmamba still parses the files
+// itself when it loads an index, and that is not measured here.
+// [[Rcpp::export]]
+r::DataFrame benchmark_repodata_parse(const char* path, int times = 3)
+{
+    fs::path file = path;
+    if (!fs::exists(file))
+        r::stop("No such file: " + file.string());
+
+    // A child that parses nothing gives the resident size every run starts from.
+    double baseline = measure_parse(file, "none").peak_mb;
+
+    std::vector<std::string> methods = { "dom", "ondemand" };
+    std::vector<double> records, seconds, throughput, peaks;
+    double size_mb = fs::file_size(file) / (1024.0 * 1024.0);
+    for (auto& method : methods)
+    {
+        ParseRun best;
+        for (int i = 0; i < std::max(times, 1); ++i)
+        {
+            r::checkUserInterrupt();
+            ParseRun run = measure_parse(file, method);
+            if (i == 0 || run.seconds < best.seconds)
+                best.seconds = run.seconds;
+            if (i == 0 || run.peak_mb > best.peak_mb)
+                best.peak_mb = run.peak_mb;
+            best.records = run.records;
+        }
+        records.push_back(best.records);
+        seconds.push_back(best.seconds);
+        throughput.push_back(best.seconds > 0 ? size_mb / best.seconds : NA_REAL);
+        peaks.push_back(std::isnan(best.peak_mb) ? NA_REAL : std::max(best.peak_mb - baseline, 0.0));
+    }
+    return r::DataFrame::create(r::Named("method") = methods,
+                                r::Named("scope") = std::vector<std::string>(methods.size(), "rhumba"),
+                                r::Named("records") = records,
+                                r::Named("seconds") = seconds,
+                                r::Named("mb_per_second") = throughput,
+                                r::Named("peak_mb") = peaks,
+                                r::Named("stringsAsFactors") = false);
+}
+
+// [[Rcpp::export]]
+r::DataFrame build_index_shards()
+{
+    mamba_use_conda_root_prefix();
+    FileLock lock(repodata_lock_path(), "repodata", false);
+
+    auto entries = cache_entries();
+    std::vector<char> built(entries.size());
+    parallel_for(entries.size(), [&](std::size_t i) { built[i] = build_shards(entries[i]); });
+
+    std::vector<std::string> channels, subdirs;
+    std::vector<double> shards;
+    std::vector<bool> rebuilt(built.begin(), built.end());
+    for (auto& entry : entries)
+    {
+        channels.push_back(entry.channel);
+        subdirs.push_back(entry.subdir);
+        // Counted from .names, as shards that were already fresh are not rebuilt.
+        shards.push_back(static_cast<double>(json::parse(read_file(shards_dir(entry) / ".names")).size()));
+    }
+    return r::DataFrame::create(r::Named("channel") = channels,
+                                r::Named("subdir") = subdirs,
+                                r::Named("packages") = shards,
+                                r::Named("rebuilt") = rebuilt,
+                                r::Named("stringsAsFactors") = false);
+}
+
+// Writes the shards of a channel's repodata.json into `dir`, to be served as
+// <channel>/<subdir>/repodata_shards/ next to it.
+// [[Rcpp::export]]
+r::List publish_index_shards(const char* repodata, const char* dir)
+{
+    fs::path source = repodata;
+    if (!fs::exists(source))
+        r::stop("No such file: " + source.string());
+    std::size_t packages = write_shards(source, dir, sha256_file(source));
+    return r::List::create(r::Named("packages") = static_cast<double>(packages),
+                           r::Named("records") = std::atof(read_file(fs::path(dir) / ".records").c_str()));
+}
+
+// [[Rcpp::export]]
+r::DataFrame repodata_filter_stats()
+{
+    std::vector<std::string> channels, subdirs;
+    std::vector<double> records, kept, dropped;
+    for (auto& stats : last_filter_stats)
+    {
+        channels.push_back(stats.channel);
+        subdirs.push_back(stats.subdir);
+        records.push_back(stats.records);
+        kept.push_back(stats.kept);
+        dropped.push_back(stats.records - stats.kept);
+    }
+    return r::DataFrame::create(r::Named("channel") = channels,
+                                r::Named("subdir") = subdirs,
+                                r::Named("records") = records,
+                                r::Named("kept") = kept,
+                                r::Named("dropped") = dropped,
+                                r::Named("stringsAsFactors") = false);
+}
+
+// Writes the JSON patch turning one repodata file into another, guarded by
+// tests on its etag and last-modified so it only applies to the right base.
+// [[Rcpp::export]]
+r::List make_index_patch(const char* old_repodata, const char* new_repodata, const char* patch_path)
+{
+    json old_json = parse_json_file(old_repodata);
+    json new_json = parse_json_file(new_repodata);
+
+    json patch = json::array();
+    for (const char* key : { "_etag", "_mod" })
+    {
+        if (old_json.contains(key))
+            patch.push_back({ { "op", "test" }, { "path", std::string("/") + key }, { "value", old_json[key] } });
+    }
+    for (auto& op : json::diff(old_json, new_json))
+        patch.push_back(op);
+    write_file(patch_path, patch.dump());
+
+    return r::List::create(r::Named("operations") = static_cast<double>(patch.size()),
+                           r::Named("bytes") = static_cast<double>(fs::file_size(patch_path)));
+}
+
+// Applies a JSON patch to the cached repodata of `url`, e.g.
+// https://conda.anaconda.org/conda-forge/linux-64, instead of downloading it
+// again, and rebuilds the shards of the packages it touches.
+// [[Rcpp::export]]
+r::List patch_index(const char* url, const char* patch)
+{
+    mamba_use_conda_root_prefix();
+    FileLock lock(repodata_lock_path(), "repodata");
+
+    std::string wanted = url;
+    while (!wanted.empty() && wanted.back() == '/')
+        wanted.pop_back();
+    auto entries = cache_entries();
+    auto entry = std::find_if(entries.begin(), entries.end(), [&wanted](const CacheEntry& e) {
+        std::string cached = e.url;
+        while (!cached.empty() && cached.back() == '/')
+            cached.pop_back();
+        return cached == wanted;
+    });
+    if (entry == entries.end())
+        r::stop("No cached repodata for " + wanted);
+
+    fs::path downloaded;
+    json operations = parse_json_file(fetch_patch(patch, downloaded));
+    if (!downloaded.empty())
+        fs::remove(downloaded);
+
+    json repodata = parse_json_file(entry->json_file);
+    json old_records;
+    for (const char* key : { "packages", "packages.conda" })
+        old_records[key] = repodata.value(key, json::object());
+
+    json patched;
+    try
+    {
+        patched = repodata.patch(operations);
+    }
+    catch (const std::exception& e)
+    {
+        r::stop(std::string("The patch does not apply to the cached repodata: ") + e.what());
+    }
+
+    double added = 0, removed = 0, changed = 0;
+    bool header_changed = false;
+    std::unordered_set<std::string> names;
+    for (auto& op : operations)
+    {
+        std::string kind = op.value("op", "");
+        auto tokens = json_pointer_tokens(op.value("path", ""));
+        if (kind == "test" || tokens.empty())
+            continue;
+        if (tokens[0] != "packages" && tokens[0] != "packages.conda")
+        {
+            header_changed = true;
+            continue;
+        }
+        if (tokens.size() < 2)
+        {
+            // The whole map was replaced, every shard is affected.
+            for (auto& [key, records] : old_records.items())
+                for (auto& [fn, record] : records.items())
+                    names.insert(record.value("name", ""));
+            for (auto& [fn, record] : patched.value(tokens[0], json::object()).items())
+                names.insert(record.value("name", ""));
+            changed += 1;
+            continue;
+        }
+
+        const std::string& fn = tokens[1];
+        if (old_records[tokens[0]].contains(fn))
+            names.insert(old_records[tokens[0]][fn].value("name", ""));
+        if (patched.contains(tokens[0]) && patched[tokens[0]].contains(fn))
+            names.insert(patched[tokens[0]][fn].value("name", ""));
+
+        if (tokens.size() == 2 && kind == "add")
+            added += 1;
+        else if (tokens.size() == 2 && kind == "remove")
+            removed += 1;
+        else
+            changed += 1;
+    }
+    names.erase("");
+
+    write_file(entry->json_file, patched.dump());
+    fs::remove(entry->solv_file);
+    update_shards(*entry, patched, names, header_changed);
+
+    return r::List::create(r::Named("added") = added,
+                           r::Named("removed") = removed,
+                           r::Named("changed") = changed,
+                           r::Named("packages") = static_cast<double>(names.size()));
+}
+
+// Saves the cached repodata of the configured channels, for solving against
+// it later with set_config("snapshot", path).
+// [[Rcpp::export]]
+r::DataFrame snapshot_channels(const char* path)
+{
+    mamba_use_conda_root_prefix();
+    FileLock lock(repodata_lock_path(), "repodata", false);
+
+    fs::path dir = snapshot_path(path);
+    if (fs::exists(dir / "index.json"))
+        r::stop("A snapshot already exists at " + dir.string());
+    fs::create_directories(dir);
+
+    auto channels = configured_channels();
+    json index = { { "platform", platform() }, { "channels", channels }, { "entries", json::array() } };
+    std::time_t now = std::time(nullptr);
+    char created[32];
+    std::strftime(created, sizeof(created), "%Y-%m-%dT%H:%M:%SZ", std::gmtime(&now));
+    index["created"] = created;
+
+    std::vector<std::string> channel_column, subdirs;
+    std::vector<double> sizes;
+    for (auto& entry : cache_entries())
+    {
+        bool configured = channels.empty()
+                          || std::any_of(channels.begin(), channels.end(), [&entry](const std::string& channel) {
+                                 return channel_matches(entry.channel, channel);
+                             });
+        if (!configured || entry.url.empty())
+            continue;
+
+        std::string file = entry.json_file.filename().string();
+        fs::copy_file(entry.json_file, dir / file, fs::copy_options::overwrite_existing);
+        auto header = cache_header(entry.json_file);
+        index["entries"].push_back({ { "file", file },
+                                     { "url", entry.url },
+                                     { "etag", header["_etag"] },
+                                     { "mod", header["_mod"] },
+                                     { "size", fs::file_size(entry.json_file) } });
+
+        channel_column.push_back(entry.channel);
+        subdirs.push_back(entry.subdir);
+        sizes.push_back(static_cast<double>(fs::file_size(entry.json_file)));
+    }
+    write_file(dir / "index.json", index.dump(4));
+
+    return r::DataFrame::create(r::Named("channel") = channel_column,
+                                r::Named("subdir") = subdirs,
+                                r::Named("size") = sizes,
+                                r::Named("stringsAsFactors") = false);
+}
+
+// [[Rcpp::export]]
+void set_channel_ttl(const char* channel, double seconds)
+{
+    auto ttls = read_channel_ttls();
+    if (seconds < 0)
+        ttls.erase(channel);
+    else
+        ttls[channel] = seconds;
+    write_file(channel_ttls_file(), json(ttls).dump(4));
+}
+
+// [[Rcpp::export]]
+void stop_index_refresher()
+{
+#ifndef _WIN32
+    if (refresher_pid > 0)
+    {
+        kill(refresher_pid, SIGTERM);
+        waitpid(refresher_pid, nullptr, 0);
+    }
+    refresher_pid = 0;
+#endif
+}
+
+// Refreshes the repodata of the channels that expired under their TTL in a
+// child Rscript every `interval` seconds, so that this session never blocks
+// on libmamba. The child exits with this session.
+// [[Rcpp::export]]
+void start_index_refresher(double interval = 900, const char* spec = "r-base")
+{
+#ifdef _WIN32
+    r::stop("The index refresher is not supported on Windows");
+#else
+    stop_index_refresher();
+    interval = std::max(interval, 1.0);
+
+    std::string expression = config_expression();
+    expression += "parent <- " + std::to_string(getpid()) + "L; ";
+    expression += "while (tools::pskill(parent, 0L)) { ";
+    expression += "try(invisible(rhumba::prebuild_index_cache(" + r_string(spec) + "))); ";
+    expression += "deadline <- Sys.time() + " + std::to_string(interval) + "; ";
+    expression += "while (Sys.time() < deadline && tools::pskill(parent, 0L)) Sys.sleep(1) }";
+    refresher_pid = spawn_rscript(expression, rhumba_dir() / "index-refresher.log");
+#endif
+}
+
+// The name-version-build of a package file, e.g. "r-base-4.3.1-h123_0", when
+// a spec of the history is its URL or path rather than a match spec; empty
+// otherwise.
+std::string package_file_dist(const std::string& spec)
+{
+    std::string file = spec.substr(0, spec.find('#'));
+    file = file.substr(file.find_last_of("/\\") + 1);
+    for (const char* extension : { ".tar.bz2", ".conda" })
+    {
+        std::size_t length = std::strlen(extension);
+        if (file.size() > length && file.compare(file.size() - length, length, extension) == 0)
+            return file.substr(0, file.size() - length);
+    }
+    return "";
+}
+
+// The package a spec of the history asks for: a match spec, possibly with
+// a channel ("conda-forge::r-base >=4"), or a package file. Empty when it
+// is none of these.
+std::string history_spec_name(const std::string& spec)
+{
+    std::string name;
+    std::string dist = package_file_dist(spec);
+    if (!dist.empty())
+    {
+        EnvPackage package;
+        if (!split_dist(dist, name, package))
+            name.clear();
+    }
+    else
+    {
+        name = spec_name(spec);
+        std::size_t channel = name.rfind("::");
+        if (channel != std::string::npos)
+            name = name.substr(channel + 2);
+    }
+    std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c) { return std::tolower(c); });
+    if (name.empty() || name.find_first_not_of("abcdefghijklmnopqrstuvwxyz0123456789-_.") != std::string::npos)
+        return "";
+    return name;
+}
+
+// The specs the user asked for over the life of a prefix, by package name:
+// the last one requested for each, unless it was removed since. Packages
+// installed from a file or URL are requested by name. Stops on entries
+// that name no package, rather than guessing what they requested.
+std::map<std::string, std::string> requested_specs(const fs::path& prefix)
+{
+    std::map<std::string, std::string> requested;
+    std::string unparsed;
+    for (auto& revision : read_history(prefix))
+    {
+        for (auto& [action, specs] : revision.requests)
+        {
+            for (auto& spec : specs)
+            {
+                std::string name = history_spec_name(spec);
+                if (name.empty())
+                    unparsed += (unparsed.empty() ? "" : ", ") + spec;
+                else if (action == "remove")
+                    requested.erase(name);
+                else if (action == "update" || action == "install" || action == "create")
+                    requested[name] = package_file_dist(spec).empty() ? spec : name;
+            }
+        }
+    }
+    if (!unparsed.empty())
+        r::stop("Cannot tell which packages the history of " + prefix.string() + " requests with " + unparsed);
+    return requested;
+}
+
+// Names of the installed packages reachable from `seeds` through their
+// dependencies, the seeds included.
+std::unordered_set<std::string> installed_closure(const std::vector<PrefixRecord>& records, std::vector<std::string> queue)
+{
+    std::unordered_map<std::string, const PrefixRecord*> by_name;
+    for (auto& rec : records)
+        by_name[rec.name] = &rec;
+
+    std::unordered_set<std::string> reached;
+    while (!queue.empty())
+    {
+        std::string name = queue.back();
+        queue.pop_back();
+        if (!reached.insert(name).second)
+            continue;
+        auto it = by_name.find(name);
+        if (it == by_name.end())
+            continue;
+        for (auto& dep : it->second->depends)
+            queue.push_back(spec_name(dep));
+    }
+    return reached;
+}
+
+// Pins every installed package an update of `specs` should not touch: all
+// but the requested ones, what they depend on and what directly depends on
+// them. The dependents are not followed further: what they depend on stays
+// pinned unless the requested packages depend on it too.
+std::vector<std::string> minimal_update_pins(const std::vector<std::string>& specs, const char* prefix)
+{
+    auto records = read_prefix_records(resolve_prefix(prefix));
+    std::unordered_set<std::string> requested;
+    std::vector<std::string> seeds;
+    for (auto& spec : specs)
+    {
+        requested.insert(spec_name(spec));
+        seeds.push_back(spec_name(spec));
+    }
+    auto cone = installed_closure(records, seeds);
+    for (auto& rec : records)
+    {
+        for (auto& dep : rec.depends)
+        {
+            if (requested.count(spec_name(dep)))
+                cone.insert(rec.name);
+        }
+    }
+
+    std::vector<std::string> pins;
+    for (auto& rec : records)
+    {
+        if (!cone.count(rec.name))
+            pins.push_back(rec.name + " " + rec.version + " " + rec.build);
+    }
+    return pins;
+}
+
+// The pins an update of `specs` with `minimal` would apply.
+// [[Rcpp::export(.minimal_update_pins)]]
+std::vector<std::string> update_pins(const std::vector<std::string>& specs, const char* prefix)
+{
+    return minimal_update_pins(specs, prefix);
+}
+
+// With prefer_installed, first tries to add the specs without changing any
+// installed package, and only solves freely when that is not possible.
+int install_specs(const std::string& command, const std::vector<std::string>& specs, int prefer_installed)
+{
+    if (prefer_installed)
+    {
+        ScopedConfig freeze("freeze_installed", "true");
+        if (run_solve(command, specs, "install", 0, false) == 0)
+            return 0;
+        r::Rcout << "The specs cannot be installed without changing installed packages, solving again" << std::endl;
+    }
+    return run_solve(command, specs, "install");
+}
+
+// [[Rcpp::export]]
+void install(const std::vector<std::string>& specs, const char* prefix = "", int prefer_installed = 0)
+{
+    if (!daemon_socket.empty())
+        return delegate({ { "command", "install" }, { "specs", specs }, { "prefix", prefix }, { "prefer_installed", prefer_installed } });
+
+    mamba_use_conda_root_prefix();
+    hide_banner();
+    TransactionLock lock(prefix);
+    RepodataFreshness freshness;
+    RepodataSubset subset(specs, prefix);
+    set_specs(specs);
+    set_prefix(prefix);
+    install_specs("install", specs, prefer_installed);
+    link_to_shared_store(prefix);
+}
+
+// Packages that ship with R itself and have no conda package of their own.
+const std::unordered_set<std::string> base_r_packages = {
+    "base", "compiler", "datasets", "grDevices", "graphics", "grid", "methods", "parallel",
+    "splines", "stats", "stats4", "tcltk", "tools", "utils"
+};
+
+// Fields of a DESCRIPTION file; continuation lines are joined.
+std::map<std::string, std::string> read_description(const fs::path& path)
+{
+    std::map<std::string, std::string> fields;
+    std::ifstream in(path.string());
+    std::string line, field;
+    while (std::getline(in, line))
+    {
+        line.erase(line.find_last_not_of(" \t\r") + 1);
+        if (line.empty())
+            continue;
+        if ((line[0] == ' ' || line[0] == '\t') && !field.empty())
+        {
+            fields[field] += " " + line.substr(line.find_first_not_of(" \t"));
+            continue;
+        }
+        std::size_t colon = line.find(':');
+        if (colon == std::string::npos)
+            continue;
+        field = line.substr(0, colon);
+        std::size_t value = line.find_first_not_of(" \t", colon + 1);
+        fields[field] = value == std::string::npos ? "" : line.substr(value);
+    }
+    return fields;
+}
+
+// R package names and conda version constraints of a DESCRIPTION dependency
+// field, e.g. "R (>= 4.1), dplyr (>= 1.0-2)" gives R ">=4.1" and dplyr
+// ">=1.0_2": conda-forge spells CRAN's "-" in versions as "_".
+std::vector<std::pair<std::string, std::string>> description_dependencies(const std::string& field)
+{
+    std::vector<std::pair<std::string, std::string>> dependencies;
+    std::size_t start = 0;
+    while (start < field.size())
+    {
+        std::size_t end = std::min(field.find(',', start), field.size());
+        std::string item = field.substr(start, end - start);
+        start = end + 1;
+
+        std::size_t name_start = item.find_first_not_of(" \t");
+        if (name_start == std::string::npos)
+            continue;
+        std::size_t name_end = std::min(item.find_first_of(" \t(", name_start), item.size());
+        std::string constraint;
+        std::size_t open = item.find('(');
+        std::size_t close = item.find(')');
+        if (open != std::string::npos && close != std::string::npos && close > open)
+        {
+            for (char c : item.substr(open + 1, close - open - 1))
+            {
+                if (c != ' ' && c != '\t')
+                    constraint += c == '-' ? '_' : c;
+            }
+        }
+        dependencies.emplace_back(item.substr(name_start, name_end - name_start), constraint);
+    }
+    return dependencies;
+}
+
+// R package names and version constraints a DESCRIPTION or renv.lock asks
+// for, and which of the names renv.lock records as coming from Bioconductor.
+// The versions renv.lock records are minimums, or exact with `strict`:
+// conda-forge does not keep every build of every version.
+std::pair<std::vector<std::pair<std::string, std::string>>, std::unordered_set<std::string>>
+r_dependencies(const fs::path& source, bool strict)
+{
+    std::vector<std::pair<std::string, std::string>> dependencies;
+    std::unordered_set<std::string> bioconductor;
+    if (source.filename() == "renv.lock")
+    {
+        json packages = parse_json_file(source).value("Packages", json::object());
+        for (auto& [name, package] : packages.items())
+        {
+            if (!package.is_object())
+            {
+                dependencies.emplace_back(name, "");
+                continue;
+            }
+            std::string package_name = package.value("Package", name);
+            std::string version = package.value("Version", "");
+            std::replace(version.begin(), version.end(), '-', '_');
+            dependencies.emplace_back(package_name, version.empty() ? "" : (strict ? "==" : ">=") + version);
+            if (package.value("Source", "") == "Bioconductor")
+                bioconductor.insert(package_name);
+        }
+    }
+    else
+    {
+        auto fields = read_description(source);
+        for (const char* field : { "Depends", "Imports", "LinkingTo" })
+        {
+            for (auto& dependency : description_dependencies(fields[field]))
+                dependencies.push_back(dependency);
+        }
+    }
+    return { dependencies, bioconductor };
+}
+
+// [[Rcpp::export(.r_dependencies)]]
+r::DataFrame r_dependencies_frame(const char* path, int strict = 0)
+{
+    auto [dependencies, bioconductor] = r_dependencies(path, strict);
+    std::vector<std::string> names, constraints;
+    std::vector<bool> from_bioconductor;
+    for (auto& [name, constraint] : dependencies)
+    {
+        names.push_back(name);
+        constraints.push_back(constraint);
+        from_bioconductor.push_back(bioconductor.count(name) > 0);
+    }
+    return r::DataFrame::create(r::Named("name") = names,
+                                r::Named("constraint") = constraints,
+                                r::Named("bioconductor") = from_bioconductor,
+                                r::Named("stringsAsFactors") = false);
+}
+
+// [[Rcpp::export]]
+r::List install_deps(const char* path = ".", const char* prefix = "", int strict = 0)
+{
+    mamba_use_conda_root_prefix();
+    fs::path source = path;
+    if (fs::is_directory(source))
+        source /= fs::exists(source / "renv.lock") && !fs::exists(source / "DESCRIPTION") ? "renv.lock" : "DESCRIPTION";
+    if (!fs::exists(source))
+        r::stop("No DESCRIPTION or renv.lock at " + std::string(path));
+    auto [dependencies, bioconductor] = r_dependencies(source, strict);
+
+    // Names the configured channels provide, from their binary indexes, to
+    // tell which CRAN names have a conda package. Unless each channel
+    // resolves and is cached, names cannot be checked and map as they are,
+    // which is reported.
+    auto trimmed = [](std::string url) {
+        while (!url.empty() && url.back() == '/')
+            url.pop_back();
+        return url;
+    };
+    std::unordered_set<std::string> urls;
+    bool resolved = true;
+    for (auto& channel : configured_channels())
+    {
+        std::string base = channel_url(channel);
+        resolved = resolved && !base.empty();
+        for (const std::string& subdir : { platform(), std::string("noarch") })
+            urls.insert(base + "/" + subdir);
+    }
+    std::unordered_set<std::string> available, indexed;
+    if (resolved && !urls.empty())
+    {
+        for (auto& [entry, index] : load_binary_indexes())
+        {
+            if (!urls.count(trimmed(entry.url)))
+                continue;
+            indexed.insert(trimmed(entry.url));
+            std::unordered_set<uint32_t> seen;
+            for (std::size_t i = 0; i < index->size(); ++i)
+            {
+                if (seen.insert(index->name_id(i)).second)
+                    available.insert(index->string(index->name_id(i)));
+            }
+        }
+    }
+    bool checked = !urls.empty() && indexed.size() == urls.size();
+
+    std::vector<std::string> specs, unmapped, unchecked;
+    std::unordered_set<std::string> added;
+    for (auto& [name, constraint] : dependencies)
+    {
+        if (base_r_packages.count(name))
+            continue;
+        std::string lower = name;
+        std::transform(lower.begin(), lower.end(), lower.begin(), [](unsigned char c) { return std::tolower(c); });
+        std::string conda_name = name == "R" ? "r-base" : (bioconductor.count(name) ? "bioconductor-" : "r-") + lower;
+        if (checked && !available.count(conda_name))
+        {
+            if (available.count("bioconductor-" + lower))
+                conda_name = "bioconductor-" + lower;
+            else
+            {
+                unmapped.push_back(name);
+                continue;
+            }
+        }
+        if (!added.insert(conda_name).second)
+            continue;
+        specs.push_back(constraint.empty() ? conda_name : conda_name + " " + constraint);
+        if (!checked)
+            unchecked.push_back(name);
+    }
+
+    if (!unmapped.empty())
+    {
+        std::string names;
+        for (auto& name : unmapped)
+            names += (names.empty() ? "" : ", ") + name;
+        r::warning("No conda package found for " + names);
+    }
+    if (!unchecked.empty())
+    {
+        std::string names;
+        for (auto& name : unchecked)
+            names += (names.empty() ? "" : ", ") + name;
+        r::warning("The repodata of the configured channels is not cached, " + names
+                   + " mapped by name without checking that a channel provides them");
+    }
+    if (!specs.empty())
+        install(specs, prefix);
+    return r::List::create(r::Named("specs") = specs, r::Named("unmapped") = unmapped, r::Named("unchecked") = unchecked);
+}
+
+// [[Rcpp::export]]
+void update(const std::vector<std::string>& specs, int update_all = 0, const char* prefix = "", int minimal = 0)
+{
+    if (!daemon_socket.empty())
+        return delegate({ { "command", "update" }, { "specs", specs }, { "update_all", update_all }, { "prefix", prefix }, { "minimal", minimal } });
+
+    mamba_use_conda_root_prefix();
+    hide_banner();
+    TransactionLock lock(prefix);
+    RepodataFreshness freshness;
+    RepodataSubset subset(specs, prefix);
+    set_specs(specs);
+    set_prefix(prefix);
+    std::unique_ptr<ScopedConfig> held;
+    std::vector<std::string> pins;
+    if (minimal && update_all)
+        r::warning("minimal has no effect with update_all, every installed package may be updated");
+    else if (minimal)
+    {
+        // The user's own pins stay in force alongside the held packages.
+        pins = minimal_update_pins(specs, prefix);
+        std::string joined = config_values.count("pinned_packages") ? config_values["pinned_packages"] : "";
+        for (auto& pin : pins)
+            joined += (joined.empty() ? "" : ",") + pin;
+        held = std::make_unique<ScopedConfig>("pinned_packages", joined);
+        r::Rcout << "Holding " << pins.size() << " installed packages outside the dependency cone of the update" << std::endl;
+    }
+    run_solve("update", specs, "update", update_all);
+    last_solve.held = static_cast<double>(pins.size());
+    link_to_shared_store(prefix);
+}
+
+// [[Rcpp::export]]
+void remove(const std::vector<std::string>& specs, int remove_all = 0, const char* prefix = "")
+{
+    if (!daemon_socket.empty())
+        return delegate({ { "command", "remove" }, { "specs", specs }, { "remove_all", remove_all }, { "prefix", prefix } });
+
+    mamba_use_conda_root_prefix();
+    hide_banner();
+    TransactionLock lock(prefix);
+    RepodataFreshness freshness;
+    set_specs(specs);
+    set_prefix(prefix);
+    run_solve("remove", specs, "remove", remove_all);
+}
+
+// Size in bytes of a size libmamba printed, e.g. "185 kB": libmamba counts
+// in powers of 1000, binary units such as "KiB" in powers of 1024.
+// [[Rcpp::export(.parse_size)]]
+double parse_size(const std::string& number, const std::string& unit)
+{
+    double bytes = std::atof(number.c_str());
+    double base = unit.find('i') != std::string::npos ? 1024 : 1000;
+    char first = unit.empty() ? '\0' : static_cast<char>(std::toupper(static_cast<unsigned char>(unit[0])));
+    for (char prefix : { 'K', 'M', 'G', 'T' })
+    {
+        bytes *= base;
+        if (first == prefix)
+            return bytes;
+    }
+    return std::atof(number.c_str());
+}
+
+// The transaction libmamba prints before running it, or instead of running
+// it in a dry run: one row per package line and the counts of its summary.
+// [[Rcpp::export(.transaction_plan)]]
+r::List transaction_plan(const std::string& output)
+{
+    std::vector<std::string> actions, changes, names, versions, builds, channels;
+    std::vector<double> sizes;
+    std::map<std::string, double> counts = { { "install", 0 }, { "reinstall", 0 }, { "upgrade", 0 },
+                                             { "downgrade", 0 }, { "change", 0 }, { "remove", 0 } };
+    double download = 0;
+
+    std::string section;
+    std::size_t start = 0;
+    while (start < output.size())
+    {
+        std::size_t end = std::min(output.find('\n', start), output.size());
+        std::string line;
+        // Drop colours.
+        for (std::size_t i = start; i < end; ++i)
+        {
+            if (output[i] == '\x1b')
+            {
+                while (i < end && !std::isalpha(static_cast<unsigned char>(output[i])))
+                    ++i;
+                continue;
+            }
+            line += output[i];
+        }
+        start = end + 1;
+
+        std::vector<std::string> tokens;
+        std::size_t pos = 0;
+        while ((pos = line.find_first_not_of(" \t\r", pos)) != std::string::npos)
+        {
+            std::size_t next = line.find_first_of(" \t\r", pos);
+            tokens.push_back(line.substr(pos, next == std::string::npos ? std::string::npos : next - pos));
+            pos = next;
+        }
+        if (tokens.empty())
+            continue;
+
+        std::string key = tokens[0];
+        std::transform(key.begin(), key.end(), key.begin(), [](unsigned char c) { return std::tolower(c); });
+        if (!key.empty() && key.back() == ':')
+            key.pop_back();
+        if (tokens.size() == 1 && (counts.count(key) || key == "summary"))
+        {
+            section = key;
+            continue;
+        }
+        if (section == "summary")
+        {
+            if (counts.count(key) && tokens.size() >= 2)
+                counts[key] = std::atof(tokens[1].c_str());
+            else if (key == "total" && tokens.size() >= 4)
+                download = parse_size(tokens[2], tokens[3]);
+            continue;
+        }
+        if (!section.empty() && (tokens[0] == "+" || tokens[0] == "-") && tokens.size() >= 5)
+        {
+            actions.push_back(section);
+            changes.push_back(tokens[0]);
+            names.push_back(tokens[1]);
+            versions.push_back(tokens[2]);
+            builds.push_back(tokens[3]);
+            channels.push_back(tokens[4]);
+            sizes.push_back(tokens.size() >= 7 ? parse_size(tokens[5], tokens[6]) : 0);
+        }
+    }
+
+    double size = 0;
+    for (auto& [action, count] : counts)
+        size += count;
+    auto packages = r::DataFrame::create(r::Named("action") = actions,
+                                         r::Named("change") = changes,
+                                         r::Named("name") = names,
+                                         r::Named("version") = versions,
+                                         r::Named("build") = builds,
+                                         r::Named("channel") = channels,
+                                         r::Named("download_bytes") = sizes,
+                                         r::Named("stringsAsFactors") = false);
+    return r::List::create(r::Named("status") = last_solve.status,
+                           r::Named("size") = size,
+                           r::Named("install") = counts["install"],
+                           r::Named("reinstall") = counts["reinstall"],
+                           r::Named("upgrade") = counts["upgrade"],
+                           r::Named("downgrade") = counts["downgrade"],
+                           r::Named("change") = counts["change"],
+                           r::Named("remove") = counts["remove"],
+                           r::Named("download_bytes") = download,
+                           r::Named("packages") = packages);
+}
+
+// [[Rcpp::export]]
+r::List plan(const std::vector<std::string>& specs, const char* prefix = "", int prefer_installed = 0)
+{
+    if (!daemon_socket.empty())
+    {
+        delegate({ { "command", "plan" }, { "specs", specs }, { "prefix", prefix }, { "prefer_installed", prefer_installed } });
+    }
+    else
+    {
+        mamba_use_conda_root_prefix();
+        hide_banner();
+        TransactionLock lock(prefix, true);
+        RepodataFreshness freshness;
+        RepodataSubset subset(specs, prefix);
+        ScopedConfig dry_run("dry_run", "true");
+        ScopedConfig always_yes("always_yes", "true");
+        set_specs(specs);
+        set_prefix(prefix);
+        install_specs("plan", specs, prefer_installed);
+    }
+    return transaction_plan(last_solve.output);
+}
+
+// Versions the channels offer for each requirement of the last report's
+// conflicts, looked up once the transaction's locks are released.
+void fill_candidates()
+{
+    if (last_solve.candidates.size() != last_solve.conflicts.size())
+    {
+        std::map<std::string, std::vector<std::string>> versions;
+        for (auto& conflict : last_solve.conflicts)
+        {
+            if (!conflict.requirement.empty())
+                versions[spec_name(conflict.requirement)];
+        }
+        if (!versions.empty())
+        {
+            for (auto& [entry, index] : load_binary_indexes())
+            {
+                for (std::size_t i = 0; i < index->size(); ++i)
+                {
+                    auto it = versions.find(index->name(i));
+                    if (it != versions.end() && std::find(it->second.begin(), it->second.end(), index->version(i)) == it->second.end())
+                        it->second.push_back(index->version(i));
+                }
+            }
+        }
+        last_solve.candidates.clear();
+        for (auto& conflict : last_solve.conflicts)
+        {
+            std::string joined;
+            if (!conflict.requirement.empty())
+            {
+                for (auto& version : versions[spec_name(conflict.requirement)])
+                    joined += (joined.empty() ? "" : ", ") + version;
+            }
+            last_solve.candidates.push_back(joined);
+        }
+    }
+}
+
+// [[Rcpp::export]]
+r::List solve_report()
+{
+    fill_candidates();
+
+    std::vector<std::string> types, packages, requirements, conflicts_with, texts;
+    for (auto& conflict : last_solve.conflicts)
+    {
+        types.push_back(conflict.type);
+        packages.push_back(conflict.package);
+        requirements.push_back(conflict.requirement);
+        conflicts_with.push_back(conflict.conflicts_with);
+        texts.push_back(conflict.text);
+    }
+    auto conflicts = r::DataFrame::create(r::Named("type") = types,
+                                          r::Named("package") = packages,
+                                          r::Named("requirement") = requirements,
+                                          r::Named("conflicts_with") = conflicts_with,
+                                          r::Named("candidates") = last_solve.candidates,
+                                          r::Named("text") = texts,
+                                          r::Named("stringsAsFactors") = false);
+    return r::List::create(r::Named("command") = last_solve.command,
+                           r::Named("specs") = last_solve.specs,
+                           r::Named("status") = last_solve.status,
+                           r::Named("seconds") = last_solve.seconds,
+                           r::Named("solve_seconds") = last_solve.solve_seconds,
+                           r::Named("timeout") = last_solve.timeout,
+                           r::Named("iterations") = last_solve.iterations,
+                           r::Named("held") = last_solve.held,
+                           r::Named("stats") = stats_list(last_solve.stats),
+                           r::Named("problems") = last_solve.problems,
+                           r::Named("conflicts") = conflicts);
+}
+
+// [[Rcpp::export]]
+r::DataFrame autoremove(const char* prefix = "", int dry_run = 0)
+{
+    mamba_use_conda_root_prefix();
+    hide_banner();
+    TransactionLock lock(prefix, dry_run != 0);
+    fs::path target = resolve_prefix(prefix);
+    auto records = read_prefix_records(target);
+
+    // What the user asked for over the life of the environment, and what
+    // that needs; pinned packages count as asked for.
+    std::vector<std::string> requested;
+    for (auto& [name, spec] : requested_specs(target))
+        requested.push_back(name);
+    if (requested.empty())
+        r::stop("The history of " + target.string() + " records no requested specs, cannot tell what is orphaned");
+    for (auto& pin : read_pins(target))
+        requested.push_back(spec_name(pin));
+    auto needed = installed_closure(records, requested);
+
+    std::vector<std::string> names, versions, builds;
+    std::vector<double> sizes;
+    for (auto& rec : records)
+    {
+        if (needed.count(rec.name))
+            continue;
+        double size = 0;
+        for (auto& path : rec.paths)
+            size += static_cast<double>(path.size);
+        names.push_back(rec.name);
+        versions.push_back(rec.version);
+        builds.push_back(rec.build);
+        sizes.push_back(size);
+    }
+
+    if (!dry_run && !names.empty())
+    {
+        set_specs(names);
+        set_prefix(prefix);
+        if (run_solve("autoremove", names, "remove") != 0)
+            r::stop("Could not remove the orphaned packages from " + target.string());
+    }
+    return r::DataFrame::create(r::Named("name") = names,
+                                r::Named("version") = versions,
+                                r::Named("build") = builds,
+                                r::Named("bytes") = sizes,
+                                r::Named("stringsAsFactors") = false);
+}
+
+// The parts of an environment.yml create_from_file() uses: its name, its
+// channels and its conda dependencies. Nested sections such as pip's are
+// skipped.
+struct EnvironmentFile
+{
+    std::string name;
+    std::vector<std::string> channels;
+    std::vector<std::string> dependencies;
+    std::vector<std::string> skipped;
+};
+
+EnvironmentFile read_environment_file(const fs::path& path)
+{
+    if (!fs::exists(path))
+        r::stop("No such file: " + path.string());
+
+    EnvironmentFile env;
+    std::ifstream in(path.string());
+    std::string line, key;
+    std::size_t item_indent = std::string::npos;
+    while (std::getline(in, line))
+    {
+        std::size_t indent = line.find_first_not_of(" ");
+        if (indent == std::string::npos || line[indent] == '#')
+            continue;
+        std::size_t comment = line.find(" #");
+        if (comment != std::string::npos)
+            line.erase(comment);
+
+        if (indent == 0 && line[0] != '-')
+        {
+            std::size_t colon = line.find(':');
+            key = line.substr(0, colon);
+            item_indent = std::string::npos;
+            if (key == "name" && colon != std::string::npos)
+                env.name = yaml_unquote(line.substr(colon + 1));
+            continue;
+        }
+        if (line[indent] != '-')
+            continue;
+        if (item_indent == std::string::npos)
+            item_indent = indent;
+        if (indent != item_indent)
+            continue;
+
+        std::string item = yaml_unquote(line.substr(indent + 1));
+        if (key == "channels")
+            env.channels.push_back(item);
+        else if (key == "dependencies" && !item.empty() && item.back() == ':')
+            env.skipped.push_back(item.substr(0, item.size() - 1));
+        else if (key == "dependencies")
+            env.dependencies.push_back(item);
+    }
+    return env;
+}
+
+// [[Rcpp::export]]
+std::string export_env(const char* prefix = "", const char* path = "", int from_history = 1)
+{
+    mamba_use_conda_root_prefix();
+    fs::path target = resolve_prefix(prefix);
+    auto records = read_prefix_records(target);
+    if (records.empty())
+        r::stop("No environment at " + target.string());
+
+    // The configured channels first, in their order of priority, then any
+    // other channel the packages came from.
+    std::vector<std::string> channels, dependencies;
+    auto add_channel = [&channels](const std::string& channel) {
+        if (!channel.empty() && std::find(channels.begin(), channels.end(), channel) == channels.end())
+            channels.push_back(channel);
+    };
+    for (auto& channel : configured_channels())
+        add_channel(short_channel(channel));
+    for (auto& rec : records)
+    {
+        add_channel(short_channel(rec.channel));
+        if (!from_history)
+            dependencies.push_back(rec.name + "=" + rec.version + "=" + rec.build);
+    }
+    if (from_history)
+    {
+        for (auto& [name, spec] : requested_specs(target))
+            dependencies.push_back(spec);
+        if (dependencies.empty())
+            r::stop("The history of " + target.string() + " records no requested specs, export with from_history = FALSE");
+    }
+
+    std::string yaml = "name: " + target.filename().string() + "\nchannels:\n";
+    for (auto& channel : channels)
+        yaml += "  - " + channel + "\n";
+    yaml += "dependencies:\n";
+    for (auto& dependency : dependencies)
+        yaml += "  - " + dependency + "\n";
+    if (*path)
+        write_file(path, yaml);
+    return yaml;
+}
+
+// [[Rcpp::export]]
+void create_from_file(const char* path, const char* prefix = "")
+{
+    EnvironmentFile env = read_environment_file(path);
+    std::string target = *prefix ? prefix : env.name;
+    if (target.empty())
+        r::stop(std::string(path) + " has no name, pass a prefix");
+    if (env.dependencies.empty())
+        r::stop(std::string(path) + " lists no dependencies");
+    for (auto& section : env.skipped)
+        r::warning("Ignoring the " + section + " dependencies of " + path);
+
+    std::unique_ptr<SessionConfig> channels;
+    if (!env.channels.empty())
+    {
+        std::string joined;
+        for (auto& channel : env.channels)
+            joined += (joined.empty() ? "" : ",") + channel;
+        channels = std::make_unique<SessionConfig>("channels", joined);
+    }
+    create(env.dependencies, target.c_str());
+}
+
+struct HistoryPackage
+{
+    std::string channel;
+    std::string dist;
+    EnvPackage package;
+};
+
+// Splits a package line of the history, [channel::]name-version-build.
+bool parse_history_entry(const std::string& entry, std::string& name, HistoryPackage& package)
+{
+    std::size_t colons = entry.rfind("::");
+    package.channel = colons == std::string::npos ? "" : entry.substr(0, colons);
+    if (!split_dist(colons == std::string::npos ? entry : entry.substr(colons + 2), name, package.package))
+        return false;
+    package.dist = name + "-" + package.package.version + "-" + package.package.build;
+    return true;
+}
+
+// The packages of a prefix after revision `last` of its history, by name.
+std::map<std::string, HistoryPackage> history_state(const std::vector<HistoryRevision>& revisions, std::size_t last)
+{
+    std::map<std::string, HistoryPackage> state;
+    for (std::size_t i = 0; i <= last && i < revisions.size(); ++i)
+    {
+        // An update lists the old build as removed and the new one as added.
+        std::string name;
+        HistoryPackage package;
+        for (auto& entry : revisions[i].removed)
+        {
+            auto it = parse_history_entry(entry, name, package) ? state.find(name) : state.end();
+            if (it != state.end() && it->second.dist == package.dist)
+                state.erase(it);
+        }
+        for (auto& entry : revisions[i].added)
+        {
+            if (parse_history_entry(entry, name, package))
+                state[name] = package;
+        }
+    }
+    return state;
+}
+
+// [[Rcpp::export(.history_state)]]
+r::DataFrame history_state_frame(const char* prefix, int revision)
+{
+    mamba_use_conda_root_prefix();
+    std::vector<std::string> names, versions, builds, channels;
+    for (auto& [name, package] : history_state(read_history(resolve_prefix(prefix)), revision))
+    {
+        names.push_back(name);
+        versions.push_back(package.package.version);
+        builds.push_back(package.package.build);
+        channels.push_back(package.channel);
+    }
+    return r::DataFrame::create(r::Named("name") = names,
+                                r::Named("version") = versions,
+                                r::Named("build") = builds,
+                                r::Named("channel") = channels,
+                                r::Named("stringsAsFactors") = false);
+}
+
+// URL of a package for an explicit install: the one its cached copy was
+// downloaded from, with its md5 so that the copy is reused, else the one of
+// the repodata currently in the cache.
+std::string package_url(const HistoryPackage& package,
+                        const std::vector<std::pair<CacheEntry, std::shared_ptr<BinaryIndex>>>& indexes,
+                        bool& cached)
+{
+    cached = false;
+    for (auto& dir : pkgs_dirs())
+    {
+        fs::path record = dir / package.dist / "info" / "repodata_record.json";
+        if (!fs::exists(record))
+            continue;
+        json j = parse_json_file(record);
+        std::string url = j.value("url", "");
+        if (url.empty())
+            continue;
+        cached = true;
+        std::string md5 = j.value("md5", "");
+        return md5.empty() ? url : url + "#" + md5;
+    }
+
+    std::string channel = short_channel(package.channel);
+    for (auto& [entry, index] : indexes)
+    {
+        if (!channel.empty() && short_channel(entry.channel) != channel)
+            continue;
+        for (std::size_t i = 0; i < index->size(); ++i)
+        {
+            std::string fn = index->fn(i);
+            if (fn.compare(0, package.dist.size(), package.dist) == 0
+                && (fn.size() == package.dist.size() + 8 || fn.size() == package.dist.size() + 6))
+                return entry.url + (entry.url.back() == '/' ? "" : "/") + fn;
+        }
+    }
+    return "";
+}
+
+// [[Rcpp::export]]
+r::DataFrame revisions(const char* prefix = "")
+{
+    mamba_use_conda_root_prefix();
+    std::vector<double> numbers, added, removed;
+    std::vector<std::string> dates, commands, specs;
+    auto history = read_history(resolve_prefix(prefix));
+    for (std::size_t i = 0; i < history.size(); ++i)
+    {
+        std::string requested;
+        for (auto& [action, list] : history[i].requests)
+        {
+            for (auto& spec : list)
+                requested += (requested.empty() ? "" : ", ") + action + " " + spec;
+        }
+        numbers.push_back(static_cast<double>(i));
+        dates.push_back(history[i].date);
+        commands.push_back(history[i].command);
+        added.push_back(static_cast<double>(history[i].added.size()));
+        removed.push_back(static_cast<double>(history[i].removed.size()));
+        specs.push_back(requested);
+    }
+    return r::DataFrame::create(r::Named("revision") = numbers,
+                                r::Named("date") = dates,
+                                r::Named("command") = commands,
+                                r::Named("added") = added,
+                                r::Named("removed") = removed,
+                                r::Named("specs") = specs,
+                                r::Named("stringsAsFactors") = false);
+}
+
+// [[Rcpp::export]]
+r::DataFrame rollback(const char* prefix, int revision, int dry_run = 0)
+{
+    mamba_use_conda_root_prefix();
+    hide_banner();
+    TransactionLock lock(prefix);
+    fs::path target = resolve_prefix(prefix);
+    auto history = read_history(target);
+    if (revision < 0 || static_cast<std::size_t>(revision) >= history.size())
+        r::stop("No revision " + std::to_string(revision) + " in the history of " + target.string());
+    auto state = history_state(history, revision);
+
+    // Packages no revision added were installed before the history began, or
+    // by another tool; the rollback removes them with the rest.
+    std::set<std::string> recorded;
+    for (auto& past : history)
+    {
+        std::string name;
+        HistoryPackage package;
+        for (auto& entry : past.added)
+        {
+            if (parse_history_entry(entry, name, package))
+                recorded.insert(name);
+        }
+    }
+    std::string unrecorded;
+    for (auto& rec : read_prefix_records(target))
+    {
+        if (!recorded.count(rec.name))
+            unrecorded += (unrecorded.empty() ? "" : ", ") + rec.name;
+    }
+    if (!unrecorded.empty())
+        r::warning("The history of " + target.string() + " does not record installing " + unrecorded
+                   + ", rolling back removes them");
+
+    // The inverse transaction: what is not in the revision goes, what it
+    // had in another version is replaced.
+    std::vector<std::string> names, actions, from, to, urls;
+    std::vector<bool> cached;
+    std::vector<std::string> remove;
+    std::unordered_set<std::string> installed;
+    std::vector<std::pair<CacheEntry, std::shared_ptr<BinaryIndex>>> indexes;
+    for (auto& rec : read_prefix_records(target))
+    {
+        installed.insert(rec.name);
+        auto it = state.find(rec.name);
+        if (it != state.end() && it->second.package.version == rec.version && it->second.package.build == rec.build)
+            continue;
+        remove.push_back(rec.name);
+        names.push_back(rec.name);
+        actions.push_back(it == state.end() ? "remove" : "change");
+        from.push_back(rec.version + "-" + rec.build);
+        to.push_back(it == state.end() ? "" : it->second.package.version + "-" + it->second.package.build);
+    }
+    for (auto& [name, package] : state)
+    {
+        if (installed.count(name))
+            continue;
+        names.push_back(name);
+        actions.push_back("install");
+        from.push_back("");
+        to.push_back(package.package.version + "-" + package.package.build);
+    }
+
+    // Every package of the revision gets a URL up front, so that nothing is
+    // removed when one of them cannot be found anymore.
+    std::map<std::string, std::string> target_urls;
+    std::vector<std::string> missing;
+    for (auto& name : names)
+    {
+        auto it = state.find(name);
+        bool is_cached = false;
+        std::string url;
+        if (it != state.end())
+        {
+            url = package_url(it->second, indexes, is_cached);
+            if (url.empty() && indexes.empty())
+            {
+                indexes = load_binary_indexes();
+                url = package_url(it->second, indexes, is_cached);
+            }
+            if (url.empty())
+                missing.push_back(it->second.dist);
+            target_urls[name] = url;
+        }
+        urls.push_back(url);
+        cached.push_back(is_cached);
+    }
+    auto plan = r::DataFrame::create(r::Named("name") = names,
+                                     r::Named("action") = actions,
+                                     r::Named("from") = from,
+                                     r::Named("to") = to,
+                                     r::Named("cached") = cached,
+                                     r::Named("url") = urls,
+                                     r::Named("stringsAsFactors") = false);
+    if (dry_run || names.empty())
+        return plan;
+    if (!missing.empty())
+    {
+        std::string list;
+        for (auto& dist : missing)
+            list += (list.empty() ? "" : ", ") + dist;
+        r::stop("Cannot find " + list + " in the package cache or the channels, not rolling back");
+    }
+
+    set_prefix(prefix);
+    if (!remove.empty())
+    {
+        set_specs(remove);
+        if (run_solve("rollback", remove, "remove") != 0)
+            r::stop("Rolling back " + target.string() + " to revision " + std::to_string(revision)
+                    + " failed while removing packages");
+    }
+
+    // Removing a package also removes what depends on it, so reinstall
+    // whatever of the revision is missing now, without solving.
+    std::string explicit_specs = "# rhumba rollback\n@EXPLICIT\n";
+    std::vector<std::string> reinstalled;
+    installed.clear();
+    for (auto& rec : read_prefix_records(target))
+        installed.insert(rec.name + "-" + rec.version + "-" + rec.build);
+    for (auto& [name, package] : state)
+    {
+        if (installed.count(package.dist))
+            continue;
+        bool is_cached = false;
+        std::string url = target_urls.count(name) ? target_urls[name] : package_url(package, indexes, is_cached);
+        if (url.empty() && indexes.empty())
+        {
+            indexes = load_binary_indexes();
+            url = package_url(package, indexes, is_cached);
+        }
+        if (url.empty())
+            r::stop("Cannot find " + package.dist + " in the package cache or the channels");
+        explicit_specs += url + "\n";
+        reinstalled.push_back(name);
+    }
+    if (!reinstalled.empty())
+    {
+        TempFile file("rhumba-rollback-", ".txt");
+        write_file(file.path(), explicit_specs);
+        int status;
+        {
+            ExplicitInstall install(file.path());
+            status = run_solve("rollback", reinstalled, "install");
+        }
+        if (status != 0)
+            r::stop("Rolling back " + target.string() + " to revision " + std::to_string(revision)
+                    + " failed while reinstalling packages, the environment is partially rolled back");
+        link_to_shared_store(prefix);
+    }
+    return plan;
+}
+
+// [[Rcpp::export]]
+void info(const char* prefix = "")
+{
+    mamba_use_conda_root_prefix();
+    set_prefix(prefix);
+    mamba_info();
+}
+
+#ifndef _WIN32
+void run_request(const json& request)
+{
+    std::string command = request.at("command");
+    auto specs = request.value("specs", std::vector<std::string>{});
+    std::string prefix = request.value("prefix", "");
+
+    if (command == "install")
+        install(specs, prefix.c_str(), request.value("prefer_installed", 0));
+    else if (command == "plan")
+        plan(specs, prefix.c_str(), request.value("prefer_installed", 0));
+    else if (command == "create")
+        create(specs, prefix.c_str(), request.value("from_template", "").c_str());
+    else if (command == "update")
+        update(specs, request.value("update_all", 0), prefix.c_str(), request.value("minimal", 0));
+    else if (command == "remove")
+        remove(specs, request.value("remove_all", 0), prefix.c_str());
+    else if (command == "list")
+        list(request.value("regex", "").c_str(), prefix.c_str());
+    else
+        throw std::runtime_error("Unknown command " + command);
+}
+
+// Runs in a child forked for the request, so the configuration and
+// environment of the calling session die with it instead of having to be
+// undone for the next one. The output is sent back a line at a time as it is
+// written; the last line carries what is left of it with the status.
+void handle_client(int client)
+{
+    std::string line;
+    if (!receive_line(client, line))
+        return;
+
+    // A client that went away, or stopped reading for the send timeout, gets
+    // no more output; its request still runs to the end.
+    bool connected = true;
+    std::string pending;
+    auto send = [client, &connected](json message) {
+        if (connected)
+            connected = send_line(client, message.dump(-1, ' ', false, json::error_handler_t::replace));
+    };
+    json reply;
+    {
+        OutputTee tee([&](const char* data, std::size_t size) {
+            pending.append(data, size);
+            std::size_t end = pending.rfind('\n');
+            if (end == std::string::npos)
+                return;
+            send({ { "output", pending.substr(0, end + 1) } });
+            pending.erase(0, end + 1);
+        });
+        try
+        {
+            json request = json::parse(line);
+            ScopedEnvironment environment(request.value("environment", std::map<std::string, std::string>{}));
+            for (auto& [name, value] : request.value("config", std::map<std::string, std::string>{}))
+                set_config(name.c_str(), value.c_str());
+
+            last_solve = SolveReport();
+            run_request(request);
+            reply["status"] = 0;
+        }
+        catch (const std::exception& e)
+        {
+            reply["status"] = 1;
+            reply["error"] = e.what();
+        }
+        tee.finish();
+    }
+    reply["output"] = pending;
+    if (last_solve.status != "none")
+    {
+        // Looked up here, from the indexes the daemon keeps mapped.
+        try
+        {
+            fill_candidates();
+        }
+        catch (const std::exception&)
+        {
+            last_solve.candidates.clear();
+        }
+        reply["report"] = { { "command", last_solve.command }, { "specs", last_solve.specs },
+                            { "status", last_solve.status }, { "seconds", last_solve.seconds },
+                            { "solve_seconds", last_solve.solve_seconds }, { "timeout", last_solve.timeout },
+                            { "iterations", last_solve.iterations }, { "held", last_solve.held },
+                            { "problems", last_solve.problems }, { "candidates", last_solve.candidates } };
+        auto& stats = last_solve.stats;
+        reply["report"]["stats"] = { { "rules", stats.rules },
+                                     { "decisions", stats.decisions },
+                                     { "backtracks", stats.backtracks },
+                                     { "learned_rules", stats.learned_rules },
+                                     { "unsolvable", stats.unsolvable },
+                                     { "minimization_steps", stats.minimization_steps },
+                                     { "solver_ms", stats.solver_ms } };
+    }
+    send(reply);
+}
+
+// Loads what the workers of a daemon start from, each forked with a copy:
+// the binary indexes of the configured channels, kept mapped, the content
+// hashes of their repodata, and their shards when sharded_repodata is on.
+// Cheap again as long as the repodata is unchanged.
+void warm_daemon()
+{
+    auto indexes = load_binary_indexes();
+    warm_indexes.clear();
+    for (auto& [entry, index] : indexes)
+        warm_indexes[binary_index_path(entry).string()] = index;
+    if (setting_enabled("sharded_repodata"))
+    {
+        FileLock lock(repodata_lock_path(), "repodata", false);
+        std::vector<CacheEntry> entries;
+        for (auto& entry : channel_entries())
+        {
+            if (fs::exists(entry.source_file))
+                entries.push_back(entry);
+        }
+        parallel_for(entries.size(), [&entries](std::size_t i) { build_shards(entries[i]); });
+    }
+}
+#endif
+
+// [[Rcpp::export]]
+void serve(const char* socket_path, int workers = 8, double refresh = 0)
+{
+#ifdef _WIN32
+    r::stop("The rhumba daemon is not supported on Windows");
+#else
+    sockaddr_un address;
+    int server = open_socket(socket_path, address);
+    unlink(socket_path);
+
+    // Only the owner may ask the daemon to modify environments.
+    mode_t old_mask = umask(0077);
+    int bound = bind(server, reinterpret_cast<sockaddr*>(&address), sizeof(address));
+    umask(old_mask);
+    if (bound != 0 || listen(server, 16) != 0)
+    {
+        close(server);
+        r::stop(std::string("Could not listen on ") + socket_path);
+    }
+
+    // Each request runs in its own forked child, so a long transaction does
+    // not hold up the others: they only wait for each other on the prefix and
+    // cache locks, as separate sessions would. libmamba's API builds its
+    // context and loads the repodata again on every call, so what the
+    // children inherit is rhumba's own state, warmed here again whenever one
+    // of them exits. The daemon never runs libmamba itself: the repodata and
+    // its .solv files are refreshed every `refresh` seconds in a child too.
+    mamba_use_conda_root_prefix();
+    auto warm = []() {
+        try
+        {
+            warm_daemon();
+        }
+        catch (const std::exception& e)
+        {
+            r::Rcout << "Could not load the repodata caches: " << e.what() << std::endl;
+        }
+    };
+    warm();
+    r::Rcout << "rhumba daemon listening on " << socket_path << std::endl;
+    std::set<pid_t> children;
+    pid_t refresher = -1;
+    auto next_refresh = std::chrono::steady_clock::now();
+    try
+    {
+        while (true)
+        {
+            bool exited = false;
+            for (auto it = children.begin(); it != children.end();)
+            {
+                bool done = waitpid(*it, nullptr, WNOHANG) != 0;
+                exited = exited || done;
+                it = done ? children.erase(it) : std::next(it);
+            }
+            if (refresher > 0 && waitpid(refresher, nullptr, WNOHANG) != 0)
+            {
+                refresher = -1;
+                exited = true;
+            }
+            if (exited)
+                warm();
+
+            if (refresh > 0 && refresher < 0 && std::chrono::steady_clock::now() >= next_refresh)
+            {
+                next_refresh = std::chrono::steady_clock::now()
+                               + std::chrono::milliseconds(static_cast<long long>(refresh * 1000));
+                refresher = fork();
+                if (refresher == 0)
+                {
+                    close(server);
+                    try
+                    {
+                        prebuild_index_cache();
+                    }
+                    catch (...)
+                    {
+                    }
+                    _exit(0);
+                }
+            }
+
+            pollfd pfd = { server, POLLIN, 0 };
+            int ready = poll(&pfd, 1, 200);
+            r::checkUserInterrupt();
+            if (ready <= 0 || static_cast<int>(children.size()) >= std::max(workers, 1))
+                continue;
+
+            int client = accept(server, nullptr, nullptr);
+            if (client < 0)
+                continue;
+            // A client that stops talking must not hold up its worker.
+            timeval timeout = { 10, 0 };
+            setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+            pid_t pid = fork();
+            if (pid == 0)
+            {
+                close(server);
+                // A client that goes away must not take the worker with it.
+                std::signal(SIGPIPE, SIG_IGN);
+                try
+                {
+                    handle_client(client);
+                }
+                catch (...)
+                {
+                }
+                close(client);
+                _exit(0);
+            }
+            if (pid < 0)
+            {
+                // Out of processes, tell the client instead of leaving it waiting.
+                json reply = { { "status", 1 }, { "error", "The rhumba daemon could not fork a worker" } };
+                send_line(client, reply.dump());
+            }
+            else
+            {
+                children.insert(pid);
+            }
+            close(client);
+        }
+    }
+    catch (...)
+    {
+        // Workers in the middle of a transaction are left to finish it.
+        close(server);
+        unlink(socket_path);
+        throw;
+    }
+#endif
+}
+
+// [[Rcpp::export]]
+void use_daemon(const char* socket_path = "")
+{
+    daemon_socket = socket_path;
 }